@@ -0,0 +1,266 @@
+#pragma once
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <random>
+#include "Node.hpp"
+#include "HashCons.hpp"
+
+/*
+性能の比較用の計測
+main から BENCHMARK を定義したときだけ呼ばれる。
+*/
+
+/*
+Evaluated を 16 バイトの値にする前の表現（関数値を共有ハンドルにする前のもの）
+関数値は捕捉した環境・引数・本体をそれぞれ値として持ち、コピーのたびに丸ごと複製される。
+*/
+struct VariantFuncVal;
+
+using VariantEvaluated = boost::variant<
+	int,
+	double,
+	Identifer,
+	boost::recursive_wrapper<VariantFuncVal>
+>;
+
+struct VariantFuncVal
+{
+	std::map<std::string, VariantEvaluated> environment;
+	std::vector<Identifer> arguments;
+	Expr expr;
+};
+
+template <class Value>
+double measureCopies(const std::vector<Value>& values, int repeat)
+{
+	const auto begin = std::chrono::steady_clock::now();
+
+	size_t checksum = 0;
+	for (int i = 0; i < repeat; ++i)
+	{
+		std::vector<Value> copied(values);
+		checksum += copied.size();
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+	return checksum == 0 ? 0.0 : values.size() * static_cast<double>(repeat) / elapsed.count();
+}
+
+template <class Value>
+double measureEnvironmentCopies(const std::vector<Value>& values, int repeat)
+{
+	std::map<std::string, Value> environment;
+	for (size_t i = 0; i < values.size(); ++i)
+	{
+		environment.emplace("v" + std::to_string(i), values[i]);
+	}
+
+	const auto begin = std::chrono::steady_clock::now();
+
+	size_t checksum = 0;
+	for (int i = 0; i < repeat; ++i)
+	{
+		std::map<std::string, Value> copied(environment);
+		checksum += copied.size();
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+	return checksum == 0 ? 0.0 : values.size() * static_cast<double>(repeat) / elapsed.count();
+}
+
+/*
+int・double・名前・関数を同じ割合で含む値の列で、値の大きさとコピーの速さを比べる。
+関数はどちらも同じ小さなクロージャ（変数 2 つを捕捉した (x, y)->(x + y)）にする。
+*/
+inline void benchmarkEvaluated(std::ostream& os, size_t count = 4096, int repeat = 200)
+{
+	const Identifer x("x"), y("y");
+	const Expr body = BinaryExpr<Add>(x, y);
+
+	VariantFuncVal variantFunc;
+	variantFunc.environment.emplace("a", 1);
+	variantFunc.environment.emplace("b", 2.5);
+	variantFunc.arguments = { x, y };
+	variantFunc.expr = body;
+
+	Environment environment;
+	environment.assign("a", 1);
+	environment.assign("b", 2.5);
+	const FuncVal func(environment, { x, y }, std::make_shared<const Expr>(body));
+
+	std::vector<VariantEvaluated> variants;
+	std::vector<Evaluated> compacts;
+	for (size_t i = 0; i < count; ++i)
+	{
+		switch (i % 4)
+		{
+		case 0: variants.push_back(static_cast<int>(i)); compacts.push_back(static_cast<int>(i)); break;
+		case 1: variants.push_back(i * 0.5); compacts.push_back(i * 0.5); break;
+		case 2: variants.push_back(Identifer("variable_name_" + std::to_string(i))); compacts.push_back(Identifer("variable_name_" + std::to_string(i))); break;
+		default: variants.push_back(variantFunc); compacts.push_back(func); break;
+		}
+	}
+
+	os << "{\"benchmark\": \"Evaluated\""
+		<< ", \"variant_bytes\": " << sizeof(VariantEvaluated)
+		<< ", \"compact_bytes\": " << sizeof(Evaluated)
+		<< ", \"variant_copies_per_sec\": " << measureCopies(variants, repeat)
+		<< ", \"compact_copies_per_sec\": " << measureCopies(compacts, repeat)
+		<< ", \"variant_environment_entries_per_sec\": " << measureEnvironmentCopies(variants, repeat / 10 + 1)
+		<< ", \"compact_environment_entries_per_sec\": " << measureEnvironmentCopies(compacts, repeat / 10 + 1)
+		<< "}" << std::endl;
+}
+
+/*
+同じ部分式を何度も含む生成スクリプト
+いくつかの変数の積・和を組み合わせた代入が続き、ときどき元の変数が書き換えられる。
+*/
+inline Lines generateDuplicateHeavyCorpus(size_t statements, unsigned seed = 1)
+{
+	std::mt19937 rng(seed);
+	const std::vector<std::string> names({ "a", "b", "c", "d" });
+
+	Lines corpus;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		corpus.add(BinaryExpr<Assign>(Identifer(names[i]), static_cast<int>(i) + 2));
+	}
+
+	const auto name = [&]() { return Identifer(names[std::uniform_int_distribution<size_t>(0, names.size() - 1)(rng)]); };
+
+	std::vector<Expr> terms;
+	for (int i = 0; i < 3; ++i)
+	{
+		terms.push_back(BinaryExpr<Add>(BinaryExpr<Mul>(name(), name()), BinaryExpr<Div>(name(), 3.0)));
+	}
+
+	const auto term = [&]() { return terms[std::uniform_int_distribution<size_t>(0, terms.size() - 1)(rng)]; };
+
+	for (size_t i = 0; i < statements; ++i)
+	{
+		if (i % 16 == 15)
+		{
+			const Identifer target = name();
+			corpus.add(BinaryExpr<Assign>(target, BinaryExpr<Add>(target, 1)));
+			continue;
+		}
+
+		Expr value = term();
+		for (int j = 0; j < 7; ++j)
+		{
+			value = j % 2 == 0 ? Expr(BinaryExpr<Add>(value, term())) : Expr(BinaryExpr<Mul>(value, term()));
+		}
+		corpus.add(BinaryExpr<Assign>(Identifer("x" + std::to_string(i % 32)), value));
+	}
+
+	return corpus;
+}
+
+template <class Clock = std::chrono::steady_clock>
+double measureEvaluation(const Expr& program, int repeat, size_t* steps)
+{
+	const auto begin = Clock::now();
+
+	for (int i = 0; i < repeat; ++i)
+	{
+		globalVariables.clear();
+		localVariables.clear();
+
+		EvalGovernor governor;
+		evalExpr(program, governor);
+		*steps = governor.steps();
+	}
+
+	const std::chrono::duration<double> elapsed = Clock::now() - begin;
+	return elapsed.count() / repeat;
+}
+
+/*
+生成スクリプトに hash-consing をかけて、AST の大きさと評価時間を比べる。
+*/
+inline void benchmarkHashCons(std::ostream& os, size_t statements = 2000, int repeat = 20)
+{
+	const Expr corpus = generateDuplicateHeavyCorpus(statements);
+
+	HashConser hashConser;
+	HashConsReport report;
+	const Expr shared = hashConser.run(corpus, &report);
+
+	size_t treeSteps = 0;
+	size_t dagSteps = 0;
+	const double treeSeconds = measureEvaluation(corpus, repeat, &treeSteps);
+	const double dagSeconds = measureEvaluation(shared, repeat, &dagSteps);
+
+	os << "{\"benchmark\": \"HashCons\""
+		<< ", \"statements\": " << statements
+		<< ", \"nodes_before\": " << report.nodesBefore
+		<< ", \"nodes_after\": " << report.nodesAfter
+		<< ", \"bytes_before\": " << report.bytesBefore
+		<< ", \"bytes_after\": " << report.bytesAfter
+		<< ", \"shared_nodes\": " << report.sharedNodes
+		<< ", \"steps_before\": " << treeSteps
+		<< ", \"steps_after\": " << dagSteps
+		<< ", \"memo_hits\": " << hashConser.memoHits()
+		<< ", \"eval_seconds_before\": " << treeSeconds
+		<< ", \"eval_seconds_after\": " << dagSeconds
+		<< "}" << std::endl;
+}
+
+/*
+大きな共通の変数群の上で小さなスクリプトを何度も動かすときの、環境を用意して捨てる費用を比べる。
+スクリプトは変数をいくつか書き換え、関数をひとつ定義する。
+*/
+inline void benchmarkFork(std::ostream& os, size_t preludeSize = 10000, int requests = 1000)
+{
+	Environment prelude;
+	std::map<std::string, Evaluated> preludeMap;
+	for (size_t i = 0; i < preludeSize; ++i)
+	{
+		prelude.assign("p" + std::to_string(i), static_cast<int>(i));
+		preludeMap.emplace("p" + std::to_string(i), static_cast<int>(i));
+	}
+
+	Lines script;
+	script.add(BinaryExpr<Assign>(Identifer("p1"), BinaryExpr<Add>(Identifer("p1"), 1)));
+	script.add(BinaryExpr<Assign>(Identifer("g"), DefFunc(std::vector<Identifer>({ Identifer("x") }), BinaryExpr<Mul>(Identifer("x"), Identifer("p2")))));
+	script.add(BinaryExpr<Add>(Identifer("p1"), Identifer("p3")));
+
+	size_t checksum = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < requests; ++i)
+	{
+		std::map<std::string, Evaluated> copied(preludeMap);
+		checksum += copied.size();
+	}
+	const std::chrono::duration<double> copySeconds = std::chrono::steady_clock::now() - begin;
+
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < requests; ++i)
+	{
+		Environment forked = prelude.fork();
+		checksum += forked.size();
+	}
+	const std::chrono::duration<double> forkSeconds = std::chrono::steady_clock::now() - begin;
+
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < requests; ++i)
+	{
+		globalVariables = prelude.fork();
+		localVariables.clear();
+		checksum += evalExpr(script).get<int>();
+	}
+	globalVariables.clear();
+	const std::chrono::duration<double> requestSeconds = std::chrono::steady_clock::now() - begin;
+
+	os << "{\"benchmark\": \"Fork\""
+		<< ", \"prelude_entries\": " << preludeSize
+		<< ", \"map_copy_seconds\": " << copySeconds.count() / requests
+		<< ", \"fork_seconds\": " << forkSeconds.count() / requests
+		<< ", \"request_seconds\": " << requestSeconds.count() / requests
+		<< ", \"checksum\": " << checksum
+		<< "}" << std::endl;
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <array>
+#include <string>
+#include <istream>
+#include <iterator>
+#include <iostream>
+#include "sample.tab.h"
+
+/*
+sample.l と同じトークンを返す手書きのスキャナ
+文字クラス表を引くだけで状態遷移が決まるので、yyFlexLexer の仮想呼び出しや yytext のコピー、istream からの逐次読み込みを経由しない。
+位置情報は LexConfig.hpp の YY_USER_ACTION (yylloc->columns(yyleng)) と同じく、空白も含めて読んだ分だけ進める。
+*/
+namespace yy
+{
+	class DfaLexer
+	{
+	public:
+
+		enum CharClass : unsigned char
+		{
+			Other = 0,
+			Whitespace = 1 << 0,
+			Newline = 1 << 1,
+			Digit = 1 << 2,
+			Alpha = 1 << 3,
+			Symbol = 1 << 4,
+			Dot = 1 << 5,
+			IdentiferHead = Alpha,
+			IdentiferTail = Alpha | Digit
+		};
+
+		/*
+		出力先は使わない（flex の Lexer と同じ形で作れるように受け取るだけ）。
+		*/
+		DfaLexer(std::istream* in, std::ostream* /*out*/ = nullptr) :
+			m_source(std::istreambuf_iterator<char>(*in), std::istreambuf_iterator<char>())
+		{}
+
+		DfaLexer(const std::string& source) :
+			m_source(source)
+		{}
+
+		DfaLexer(const DfaLexer&) = delete;
+		DfaLexer& operator=(const DfaLexer&) = delete;
+
+		int lex(parser::semantic_type* yylval, parser::location_type* yylloc)
+		{
+			typedef parser::token P_Token;
+
+			yylloc->step();
+
+			const char* const end = m_source.data() + m_source.size();
+
+			while (m_current != end)
+			{
+				const char* const begin = m_current;
+				const unsigned char c = static_cast<unsigned char>(*m_current);
+				const unsigned char cls = Classes()[c];
+
+				if (cls & Whitespace)
+				{
+					m_current = skip(m_current + 1, end, Whitespace);
+					yylloc->columns(static_cast<int>(m_current - begin));
+					continue;
+				}
+
+				if (cls & Digit)
+				{
+					m_current = c == '0' ? m_current + 1 : skip(m_current + 1, end, Digit);
+
+					if (m_current != end && *m_current == '.')
+					{
+						m_current = skip(m_current + 1, end, Digit);
+						yylloc->columns(static_cast<int>(m_current - begin));
+						yylval->build<Expr>(Expr(std::stod(std::string(begin, m_current))));
+						return P_Token::VALUE;
+					}
+
+					yylloc->columns(static_cast<int>(m_current - begin));
+					yylval->build<Expr>(Expr(std::stoi(std::string(begin, m_current))));
+					return P_Token::VALUE;
+				}
+
+				if (cls & IdentiferHead)
+				{
+					m_current = skip(m_current + 1, end, IdentiferTail);
+					yylloc->columns(static_cast<int>(m_current - begin));
+					yylval->build<Identifer>(Identifer(std::string(begin, m_current)));
+					return P_Token::NAME;
+				}
+
+				if (cls & Symbol)
+				{
+					++m_current;
+
+					if (c == '-' && m_current != end && *m_current == '>')
+					{
+						++m_current;
+						yylloc->columns(2);
+						return P_Token::arrow;
+					}
+
+					yylloc->columns(1);
+					return c;
+				}
+
+				if (cls & Newline)
+				{
+					++m_current;
+					yylloc->columns(1);
+					yylloc->lines(1);
+					return P_Token::LF;
+				}
+
+				++m_current;
+				yylloc->columns(1);
+				std::cout << "Error(" << *begin << ")" << std::endl;
+			}
+
+			return 0;
+		}
+
+	private:
+
+		static const std::array<unsigned char, 256>& Classes()
+		{
+			static const std::array<unsigned char, 256> classes = []()
+			{
+				std::array<unsigned char, 256> table = {};
+
+				for (const char c : std::string(" \t\r"))
+				{
+					table[static_cast<unsigned char>(c)] = Whitespace;
+				}
+
+				table['\n'] = Newline;
+				table['.'] = Dot;
+
+				for (char c = '0'; c <= '9'; ++c)
+				{
+					table[static_cast<unsigned char>(c)] = Digit;
+				}
+
+				for (char c = 'a'; c <= 'z'; ++c)
+				{
+					table[static_cast<unsigned char>(c)] = Alpha;
+					table[static_cast<unsigned char>(c - 'a' + 'A')] = Alpha;
+				}
+
+				table['_'] = Alpha;
+
+				for (const char c : std::string("+-*/^=><(){}[]:\\,"))
+				{
+					table[static_cast<unsigned char>(c)] = Symbol;
+				}
+
+				return table;
+			}();
+
+			return classes;
+		}
+
+		static const char* skip(const char* it, const char* end, unsigned char cls)
+		{
+			const auto& classes = Classes();
+
+			while (it != end && (classes[static_cast<unsigned char>(*it)] & cls))
+			{
+				++it;
+			}
+
+			return it;
+		}
+
+		std::string m_source;
+		const char* m_current = m_source.data();
+	};
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include <exception>
+#include <mutex>
+#include <boost/context/fiber.hpp>
+#include <boost/context/protected_fixedsize_stack.hpp>
+#include "Node.hpp"
+
+/*
+途中で中断・再開できる評価
+Eval は apply_visitor の再帰でそのまま動かし、専用のスタック（Boost.Context の fiber）の上で実行する。
+EvalGovernor のスライスごとに呼び出し元へ制御を返すので、resume を順に呼べば複数の評価を公平に交互に進められる。
+リンクには boost_context が必要。
+*/
+
+class EvalTask
+{
+public:
+
+	static const size_t DefaultStackBytes = 1024 * 1024;
+
+	/*
+	yieldSteps ステップ評価するごとに resume から戻る。
+	変数環境はタスクごとに持ち、resume の間だけ globalVariables などと入れ替える。
+	*/
+	EvalTask(const Expr& expr, size_t yieldSteps = EvalGovernor::SliceSteps, const EvalLimits& limits = EvalLimits(), const EvalOptions& options = EvalOptions(), size_t stackBytes = DefaultStackBytes) :
+		m_expr(expr),
+		m_governor(limits),
+		m_options(options)
+	{
+		m_governor.setSliceHandler(yieldSteps, [this]() { suspend(); });
+
+		m_fiber = boost::context::fiber(std::allocator_arg, boost::context::protected_fixedsize_stack(stackBytes),
+			[this](boost::context::fiber&& caller)
+		{
+			m_caller = std::move(caller);
+
+			try
+			{
+				m_result = evalExpr(m_expr, m_governor, m_options);
+			}
+			catch (const Cancelled&)
+			{}
+			catch (const boost::context::detail::forced_unwind&)
+			{
+				throw;
+			}
+			catch (...)
+			{
+				m_error = std::current_exception();
+			}
+
+			m_done = true;
+			return std::move(m_caller);
+		});
+	}
+
+	EvalTask(const EvalTask&) = delete;
+	EvalTask& operator=(const EvalTask&) = delete;
+
+	/*
+	中断中に破棄されたときは評価中のスタックを巻き戻してから解放する（巻き戻し中の例外は捨てる）。
+	まだ一度も resume していない fiber は評価を始めずにそのまま解放する。
+	*/
+	~EvalTask()
+	{
+		if (m_started && !m_done)
+		{
+			m_cancel = true;
+			run();
+			m_error = nullptr;
+		}
+	}
+
+	/*
+	次の中断点まで評価を進め、評価が終わったら true を返す。
+	どのスレッドから呼んでもよいが、インタプリタの大域変数を共有するため同時に進むのはひとつのタスクだけになる。
+	評価が例外で終わったときはその例外をここから投げる。
+	*/
+	bool resume()
+	{
+		if (!m_done)
+		{
+			run();
+		}
+
+		if (m_error)
+		{
+			std::exception_ptr error = m_error;
+			m_error = nullptr;
+			std::rethrow_exception(error);
+		}
+
+		return m_done;
+	}
+
+	bool done()const
+	{
+		return m_done;
+	}
+
+	const Evaluated& result()const
+	{
+		return m_result;
+	}
+
+	/*
+	タスクの大域変数（評価の前に値を入れておくこともできる）
+	*/
+	Environment& variables()
+	{
+		return m_globalVariables;
+	}
+
+	const EvalGovernor& governor()const
+	{
+		return m_governor;
+	}
+
+private:
+
+	class Cancelled
+	{};
+
+	static std::mutex& Mutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	/*
+	次の中断点か評価の終わりまで fiber を進める。
+	*/
+	void run()
+	{
+		std::lock_guard<std::mutex> lock(Mutex());
+
+		m_started = true;
+		swapState();
+		m_fiber = std::move(m_fiber).resume();
+		swapState();
+	}
+
+	/*
+	大域変数とメモリ計測の段階をタスクのものと入れ替える。
+	版番号は入れ替えずに進めて、他のタスクで作られたキャッシュやメモを使わないようにする。
+	*/
+	void swapState()
+	{
+		std::swap(globalVariables, m_globalVariables);
+		std::swap(localVariables, m_localVariables);
+		std::swap(currentScope, m_currentScope);
+		std::swap(AllocationStage::Current(), m_allocationStage);
+		++bindingVersion;
+		++variablesVersion;
+	}
+
+	void suspend()
+	{
+		m_caller = std::move(m_caller).resume();
+
+		if (m_cancel)
+		{
+			throw Cancelled();
+		}
+	}
+
+	Expr m_expr;
+	EvalGovernor m_governor;
+	EvalOptions m_options;
+
+	boost::context::fiber m_fiber;
+	boost::context::fiber m_caller;
+
+	Environment m_globalVariables;
+	Environment m_localVariables;
+	const FuncValData* m_currentScope = nullptr;
+	AllocationStage* m_allocationStage = nullptr;
+
+	Evaluated m_result;
+	std::exception_ptr m_error;
+	bool m_started = false;
+	bool m_done = false;
+	bool m_cancel = false;
+};
@@ -0,0 +1,1152 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Node.hpp"
+#include "HashCons.hpp"
+#include "EvalTask.hpp"
+
+/*
+評価の高速化した経路が基準の Eval と同じ結果を返すかを、ランダムなプログラムで比べる。
+プログラムは sample.y の生成規則に沿って作り、文法だけのモードでは一度ソースに戻して構文解析を通す。
+変数モードでは文法にまだない名前の参照・代入・関数呼び出しも AST で直接作る。
+*/
+
+/*
+生成のための選択の列
+乱数から作るか、libFuzzer から渡されたバイト列から読む（読み切ったら常に 0 を返すので生成は葉で止まる）。
+*/
+class FuzzChoices
+{
+public:
+
+	FuzzChoices(unsigned seed) :
+		m_rng(seed)
+	{}
+
+	FuzzChoices(const uint8_t* data, size_t size) :
+		m_data(data),
+		m_size(size)
+	{}
+
+	/*
+	[0, n) の値
+	*/
+	unsigned next(unsigned n)
+	{
+		if (n <= 1)
+		{
+			return 0;
+		}
+
+		if (m_data)
+		{
+			if (m_position == m_size)
+			{
+				return 0;
+			}
+			return m_data[m_position++] % n;
+		}
+
+		return std::uniform_int_distribution<unsigned>(0, n - 1)(m_rng);
+	}
+
+private:
+
+	std::mt19937 m_rng;
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+	size_t m_position = 0;
+};
+
+class ProgramGenerator
+{
+public:
+
+	static const int MaxDepth = 4;
+
+	ProgramGenerator(FuzzChoices& choices, bool variables) :
+		m_choices(choices),
+		m_variables(variables)
+	{
+		/*
+		引数を取る関数を多めにする（引数のない関数は def_func の項でも作られる）。
+		*/
+		for (size_t i = 0; i < FunctionNames().size(); ++i)
+		{
+			m_arities.push_back(std::min(m_choices.next(4), 2u));
+		}
+	}
+
+	static const std::vector<std::string>& VariableNames()
+	{
+		static const std::vector<std::string> names({ "a", "b", "c" });
+		return names;
+	}
+
+	static const std::vector<std::string>& FunctionNames()
+	{
+		static const std::vector<std::string> names({ "f", "g" });
+		return names;
+	}
+
+	/*
+	prog : lines
+	変数モードでは呼び出しが空振りしないよう、先頭で関数を定義しておくことが多い。
+	*/
+	Lines program()
+	{
+		if (!m_variables)
+		{
+			return lines(0);
+		}
+
+		Lines result;
+		for (size_t i = 0; i < FunctionNames().size(); ++i)
+		{
+			if (m_choices.next(3) != 0)
+			{
+				result.add(BinaryExpr<Assign>(Identifer(FunctionNames()[i]), defFunc(1, m_arities[i])));
+			}
+		}
+		for (const auto& expr : lines(0).exprs)
+		{
+			result.add(expr);
+		}
+		return result;
+	}
+
+private:
+
+	/*
+	lines : expr_seq
+	expr_seq : item | item ',' expr_seq | item LF expr_seq
+	*/
+	Lines lines(int depth)
+	{
+		Lines result;
+		const unsigned count = 1 + m_choices.next(depth == 0 ? 6 : 3);
+		for (unsigned i = 0; i < count; ++i)
+		{
+			result.add(item(depth));
+		}
+		return result;
+	}
+
+	/*
+	関数の本体では代入を多めにし、本体の外では関数を呼んで結果を変数に入れる文も多くする
+	（遅延された引数が後の呼び出しの中の代入に影響されないかを試すため）。
+	途中の文の値は比べられないので、呼び出しの結果は変数に残す。
+	*/
+	Expr item(int depth)
+	{
+		if (m_variables && depth < MaxDepth)
+		{
+			switch (m_choices.next(m_inBody ? 2 : 4))
+			{
+			case 0: return assignment(depth);
+			case 1:
+				if (!m_inBody)
+				{
+					const auto& names = VariableNames();
+					return BinaryExpr<Assign>(Identifer(names[m_choices.next(static_cast<unsigned>(names.size()))]), BinaryExpr<Add>(call(depth + 1), 0));
+				}
+				break;
+			default: break;
+			}
+		}
+		return expr(depth);
+	}
+
+	/*
+	expr : term | expr '+' expr | expr '-' expr | expr '=' expr
+	*/
+	Expr expr(int depth)
+	{
+		if (depth < MaxDepth)
+		{
+			switch (m_choices.next(6))
+			{
+			case 1: return BinaryExpr<Add>(expr(depth + 1), expr(depth + 1));
+			case 2: return BinaryExpr<Sub>(expr(depth + 1), expr(depth + 1));
+			case 3:
+				/*
+				左辺が名前でない代入はエラーになって 0.0 を返す（文法だけのモードでも作れる）。
+				*/
+				if (!m_variables && m_choices.next(4) == 0)
+				{
+					return BinaryExpr<Assign>(term(depth + 1), arithmetic(depth + 1));
+				}
+				break;
+			default: break;
+			}
+		}
+		return term(depth);
+	}
+
+	/*
+	term : factor | term '*' term | term '/' term | term '^' term
+	整数の割り算（Pow も割り算になる）で 0 除算が起きないよう、右辺は 0 でない整数か必ず double になる式にする。
+	*/
+	Expr term(int depth)
+	{
+		if (depth < MaxDepth)
+		{
+			switch (m_choices.next(6))
+			{
+			case 1: return BinaryExpr<Mul>(term(depth + 1), term(depth + 1));
+			case 2: return BinaryExpr<Div>(term(depth + 1), divisor(depth + 1));
+			case 3: return BinaryExpr<Pow>(term(depth + 1), divisor(depth + 1));
+			default: break;
+			}
+		}
+		return factor(depth);
+	}
+
+	Expr divisor(int depth)
+	{
+		if (m_choices.next(2) == 0)
+		{
+			return static_cast<int>(1 + m_choices.next(9));
+		}
+		return BinaryExpr<Add>(factor(depth), 0.5);
+	}
+
+	/*
+	factor : VALUE | '(' expr ')' | '(' lines ')' | '+' factor | '-' factor | def_func
+	変数モードでは NAME と関数呼び出しが加わる。
+	*/
+	Expr factor(int depth)
+	{
+		if (depth >= MaxDepth)
+		{
+			return value();
+		}
+
+		switch (m_choices.next(m_variables ? 9 : 6))
+		{
+		case 1: return expr(depth + 1);
+		case 2: return lines(depth + 1);
+		case 3: return UnaryExpr<Add>(factor(depth + 1));
+		case 4: return UnaryExpr<Sub>(factor(depth + 1));
+		case 5: return defFunc(depth + 1, m_choices.next(3));
+		case 6:
+		case 7: return name();
+		case 8: return call(depth + 1);
+		default: return value();
+		}
+	}
+
+	Expr value()
+	{
+		if (m_choices.next(3) == 0)
+		{
+			return m_choices.next(8) + 0.25 * (1 + m_choices.next(3));
+		}
+		return static_cast<int>(m_choices.next(10));
+	}
+
+	/*
+	def_func : '(' ')' arrow '(' ')' | '(' ')' arrow '(' lines ')' | '(' arguments ')' arrow '(' lines ')'
+	引数名には外側の変数名も使い、呼び出し先で外側の名前が隠される場合を作る。
+	*/
+	Expr defFunc(int depth, unsigned arity)
+	{
+		static const std::vector<std::string> parameters({ "a", "b", "c", "x", "y" });
+
+		std::vector<Identifer> arguments;
+		const unsigned offset = m_choices.next(m_variables && m_choices.next(2) == 0 ? 3 : static_cast<unsigned>(parameters.size()));
+		for (unsigned i = 0; i < arity; ++i)
+		{
+			arguments.push_back(Identifer(parameters[(offset + i) % parameters.size()]));
+		}
+
+		/*
+		本体でも関数を呼ぶ。再帰は呼び出しの深さの制限で打ち切られ、その打ち切りも結果として比べる。
+		*/
+		const bool inBody = m_inBody;
+		const std::vector<Identifer> parametersInScope = m_parameters;
+		m_inBody = true;
+		m_parameters = arguments;
+		Expr body;
+		if (arity != 0 || m_choices.next(4) != 0)
+		{
+			Lines bodyLines = lines(depth);
+			if (m_variables && arity != 0 && m_choices.next(2) == 0)
+			{
+				bodyLines.add(BinaryExpr<Add>(arguments[m_choices.next(arity)], arithmetic(depth + 1)));
+			}
+			body = bodyLines;
+		}
+		m_inBody = inBody;
+		m_parameters = parametersInScope;
+
+		return DefFunc(arguments, body);
+	}
+
+	/*
+	関数の本体では自分の引数を読むことも多い。
+	*/
+	Expr name()
+	{
+		if (!m_parameters.empty() && m_choices.next(2) == 0)
+		{
+			return m_parameters[m_choices.next(static_cast<unsigned>(m_parameters.size()))];
+		}
+		if (m_choices.next(6) == 0)
+		{
+			return Identifer(FunctionNames()[m_choices.next(static_cast<unsigned>(FunctionNames().size()))]);
+		}
+		return Identifer(VariableNames()[m_choices.next(static_cast<unsigned>(VariableNames().size()))]);
+	}
+
+	Expr call(int depth)
+	{
+		const unsigned index = m_choices.next(static_cast<unsigned>(FunctionNames().size()));
+		std::vector<Expr> arguments;
+		for (unsigned i = 0; i < m_arities[index]; ++i)
+		{
+			arguments.push_back(argument(depth + 1));
+		}
+		return CallFunc(Identifer(FunctionNames()[index]), arguments);
+	}
+
+	/*
+	外側の名前を読む式（遅延される）と呼び出しを多めにし、
+	先に遅延された引数の後で呼び出し先の代入が走るようにする。
+	*/
+	Expr argument(int depth)
+	{
+		if (depth < MaxDepth)
+		{
+			switch (m_choices.next(3))
+			{
+			case 0: return call(depth);
+			case 1:
+			{
+				const auto& names = VariableNames();
+				return BinaryExpr<Mul>(Identifer(names[m_choices.next(static_cast<unsigned>(names.size()))]), static_cast<int>(1 + m_choices.next(3)));
+			}
+			default: break;
+			}
+		}
+		return arithmetic(depth);
+	}
+
+	/*
+	関数名ごとに引数の数は固定する。
+	変数には名前も束縛する（名前が互いを指すと Ref が循環を検出して打ち切り、その打ち切りも結果として比べる）。
+	*/
+	Expr assignment(int depth)
+	{
+		if (m_choices.next(m_inBody ? 6 : 3) == 0)
+		{
+			const unsigned index = m_choices.next(static_cast<unsigned>(FunctionNames().size()));
+			return BinaryExpr<Assign>(Identifer(FunctionNames()[index]), defFunc(depth + 1, m_arities[index]));
+		}
+
+		const auto& names = VariableNames();
+		const Identifer target(names[m_choices.next(static_cast<unsigned>(names.size()))]);
+		if (m_choices.next(4) == 0)
+		{
+			return BinaryExpr<Assign>(target, name());
+		}
+		return BinaryExpr<Assign>(target, arithmetic(depth + 1));
+	}
+
+	/*
+	必ず数になる式
+	*/
+	Expr arithmetic(int depth)
+	{
+		switch (m_choices.next(4))
+		{
+		case 0: return value();
+		case 1: return UnaryExpr<Sub>(factor(depth));
+		case 2: return BinaryExpr<Mul>(term(depth), term(depth));
+		default: return BinaryExpr<Add>(expr(depth), expr(depth));
+		}
+	}
+
+	FuzzChoices& m_choices;
+	bool m_variables;
+	bool m_inBody = false;
+	std::vector<Identifer> m_parameters;
+	std::vector<unsigned> m_arities;
+};
+
+/*
+sample.y が読めるソースに戻す（文法だけのモードで作った AST のみ）。
+優先順位に頼らないよう二項演算は必ず括弧で囲む。
+*/
+class SourcePrinter : public boost::static_visitor<void>
+{
+public:
+
+	std::ostringstream os;
+
+	void operator()(int node)
+	{
+		os << node;
+	}
+
+	void operator()(double node)
+	{
+		std::ostringstream str;
+		str.precision(17);
+		str << node;
+		os << str.str();
+		if (str.str().find('.') == std::string::npos)
+		{
+			os << ".0";
+		}
+	}
+
+	void operator()(const Identifer& node)
+	{
+		os << node.name;
+	}
+
+	void operator()(const SharedExpr& node)
+	{
+		boost::apply_visitor(*this, node.node->expr);
+	}
+
+	void operator()(const UnaryExpr<Add>& node)
+	{
+		os << "+";
+		boost::apply_visitor(*this, node.lhs);
+	}
+
+	void operator()(const UnaryExpr<Sub>& node)
+	{
+		os << "-";
+		boost::apply_visitor(*this, node.lhs);
+	}
+
+	void operator()(const BinaryExpr<Add>& node) { binary(node.lhs, " + ", node.rhs); }
+	void operator()(const BinaryExpr<Sub>& node) { binary(node.lhs, " - ", node.rhs); }
+	void operator()(const BinaryExpr<Mul>& node) { binary(node.lhs, " * ", node.rhs); }
+	void operator()(const BinaryExpr<Div>& node) { binary(node.lhs, " / ", node.rhs); }
+	void operator()(const BinaryExpr<Pow>& node) { binary(node.lhs, " ^ ", node.rhs); }
+	void operator()(const BinaryExpr<Assign>& node) { binary(node.lhs, " = ", node.rhs); }
+
+	void operator()(const DefFunc& node)
+	{
+		os << "(";
+		for (size_t i = 0; i < node.arguments.size(); ++i)
+		{
+			os << (i == 0 ? "" : ", ") << node.arguments[i].name;
+		}
+		os << ")->(";
+		if (SameType(node.expr->type(), typeid(Lines)))
+		{
+			sequence(boost::get<Lines>(*node.expr).exprs);
+		}
+		else if (!(SameType(node.expr->type(), typeid(int)) && boost::get<int>(*node.expr) == 0))
+		{
+			boost::apply_visitor(*this, *node.expr);
+		}
+		os << ")";
+	}
+
+	void operator()(const CallFunc&)
+	{
+		os << "<call>";
+	}
+
+	void operator()(const Statement& node)
+	{
+		os << "(";
+		sequence(node.exprs);
+		os << ")";
+	}
+
+	void operator()(const Lines& node)
+	{
+		os << "(";
+		sequence(node.exprs);
+		os << ")";
+	}
+
+	/*
+	最上位の lines（括弧で囲まない）
+	*/
+	void sequence(const std::vector<Expr>& exprs)
+	{
+		for (size_t i = 0; i < exprs.size(); ++i)
+		{
+			os << (i == 0 ? "" : (i % 3 == 2 ? " \n " : ", "));
+			boost::apply_visitor(*this, exprs[i]);
+		}
+	}
+
+private:
+
+	void binary(const Expr& lhs, const char* op, const Expr& rhs)
+	{
+		os << "(";
+		boost::apply_visitor(*this, lhs);
+		os << op;
+		boost::apply_visitor(*this, rhs);
+		os << ")";
+	}
+};
+
+inline std::string ToSource(const Lines& program)
+{
+	SourcePrinter printer;
+	printer.sequence(program.exprs);
+	return printer.os.str();
+}
+
+/*
+ひとつの評価経路で動かした結果（値と、最後の大域変数）
+*/
+struct FuzzOutcome
+{
+	std::string result;
+	std::string variables;
+	bool inconclusive = false;
+	bool referenceCycle = false;
+
+	bool operator==(const FuzzOutcome& other)const
+	{
+		return result == other.result && variables == other.variables;
+	}
+};
+
+/*
+int と double を区別し、double はビット列まで比べられるように文字列にする。
+*/
+inline std::string DescribeEvaluated(const Evaluated& value)
+{
+	const Evaluated& forced = Force(value);
+
+	if (forced.is<int>())
+	{
+		return "int:" + std::to_string(forced.get<int>());
+	}
+	if (forced.is<double>())
+	{
+		const double d = forced.get<double>();
+		if (std::isnan(d))
+		{
+			return "double:nan";
+		}
+		uint64_t bits = 0;
+		std::memcpy(&bits, &d, sizeof(d));
+		std::ostringstream os;
+		os << "double:" << d << "#" << std::hex << bits;
+		return os.str();
+	}
+	if (forced.is<Identifer>())
+	{
+		return "name:" + forced.get<Identifer>().name;
+	}
+	if (forced.is<FuncVal>())
+	{
+		std::string str = "func(";
+		for (const auto& argument : forced.get<FuncVal>().arguments())
+		{
+			str += argument.name + ";";
+		}
+		return str + ")";
+	}
+	return "?";
+}
+
+inline std::string DescribeVariables(const Environment& variables)
+{
+	std::string str;
+	for (const auto& names : { ProgramGenerator::VariableNames(), ProgramGenerator::FunctionNames() })
+	{
+		for (const auto& name : names)
+		{
+			const Evaluated* value = variables.find(name);
+			str += name + "=" + (value ? DescribeEvaluated(*value) : std::string("undefined")) + " ";
+		}
+	}
+	return str;
+}
+
+/*
+比べる評価経路
+どれも prelude の変数が入った環境から始める。
+*/
+class DifferentialRunner
+{
+public:
+
+	/*
+	skipsUnusedValues: 使わない値を評価しない経路（その値の中の名前の循環では止まらないことがある）
+	*/
+	struct Backend
+	{
+		std::string name;
+		std::function<FuzzOutcome(const Expr&)> run;
+		bool skipsUnusedValues = false;
+	};
+
+	DifferentialRunner()
+	{
+		m_prelude.assign("a", 2);
+		m_prelude.assign("b", 3.5);
+
+		m_backends.push_back({ "inline-cache", [this](const Expr& program) { return evaluate(program, withOptions(false, true), m_prelude.fork()); } });
+		m_backends.push_back({ "lazy", [this](const Expr& program) { return evaluate(program, withOptions(true, true), m_prelude.fork()); }, true });
+		m_backends.push_back({ "hash-cons", [this](const Expr& program) { return evaluate(hashConsExpr(program), withOptions(false, true), m_prelude.fork()); } });
+		m_backends.push_back({ "eval-task", [this](const Expr& program) { return evaluateTask(program); } });
+	}
+
+	/*
+	基準の評価（キャッシュ・遅延評価なし、層を持たない環境）
+	*/
+	FuzzOutcome reference(const Expr& program)
+	{
+		Environment variables;
+		variables.assign("a", 2);
+		variables.assign("b", 3.5);
+		return evaluate(program, withOptions(false, false), std::move(variables));
+	}
+
+	const std::vector<Backend>& backends()const
+	{
+		return m_backends;
+	}
+
+	/*
+	基準と結果が食い違う経路の名前（なければ空）
+	*/
+	std::string mismatch(const Expr& program)
+	{
+		const FuzzOutcome expected = reference(program);
+		if (expected.inconclusive)
+		{
+			return "";
+		}
+
+		for (const auto& backend : m_backends)
+		{
+			const FuzzOutcome actual = backend.run(program);
+			if (backend.skipsUnusedValues && (expected.referenceCycle || actual.referenceCycle))
+			{
+				continue;
+			}
+			if (!(actual == expected))
+			{
+				return backend.name;
+			}
+		}
+		return "";
+	}
+
+private:
+
+	static const size_t MaxSteps = 200000;
+	static const size_t MaxCallDepth = 16;
+
+	static EvalOptions withOptions(bool lazy, bool inlineCache)
+	{
+		EvalOptions options;
+		options.lazy = lazy;
+		options.inlineCache = inlineCache;
+		return options;
+	}
+
+	static EvalLimits limits()
+	{
+		EvalLimits limits;
+		limits.maxSteps = MaxSteps;
+		limits.maxCallDepth = MaxCallDepth;
+		return limits;
+	}
+
+	/*
+	経路によって評価するステップの数は違う（読み捨てた式や同じ部分式を評価しない）ので、ステップ数などで止まったときは比べない。
+	呼び出しの深さと名前の循環で止まったときは変数と一緒に結果として比べる（使わない値を評価しない経路の名前の循環は除く）。
+	*/
+	static void Interrupted(const EvalLimitError& error, const Environment& variables, FuzzOutcome& outcome)
+	{
+		if (dynamic_cast<const CallDepthExceeded*>(&error) || dynamic_cast<const ReferenceCycleDetected*>(&error))
+		{
+			outcome.result = std::string("error:") + error.what();
+			outcome.variables = DescribeVariables(variables);
+			outcome.referenceCycle = dynamic_cast<const ReferenceCycleDetected*>(&error) != nullptr;
+		}
+		else
+		{
+			outcome.inconclusive = true;
+		}
+	}
+
+	/*
+	評価中のエラー出力は経路によって回数が変わる（読み捨てた式を評価しない等）ので比べずに捨てる。
+	*/
+	class Silence
+	{
+	public:
+
+		Silence() :
+			m_buf(std::cerr.rdbuf(nullptr))
+		{}
+
+		~Silence()
+		{
+			std::cerr.rdbuf(m_buf);
+			std::cerr.clear();
+		}
+
+	private:
+
+		std::streambuf* m_buf;
+	};
+
+	static FuzzOutcome evaluate(const Expr& program, const EvalOptions& options, Environment variables)
+	{
+		Silence silence;
+		FuzzOutcome outcome;
+
+		globalVariables = std::move(variables);
+		localVariables.clear();
+		try
+		{
+			EvalGovernor governor(limits());
+			outcome.result = DescribeEvaluated(evalExpr(program, governor, options));
+			outcome.variables = DescribeVariables(globalVariables);
+		}
+		catch (const EvalLimitError& error)
+		{
+			Interrupted(error, globalVariables, outcome);
+		}
+		globalVariables.clear();
+
+		return outcome;
+	}
+
+	FuzzOutcome evaluateTask(const Expr& program)
+	{
+		Silence silence;
+		FuzzOutcome outcome;
+
+		EvalTask task(program, 1, limits());
+		task.variables() = m_prelude.fork();
+		try
+		{
+			while (!task.resume())
+			{
+			}
+			outcome.result = DescribeEvaluated(task.result());
+			outcome.variables = DescribeVariables(task.variables());
+		}
+		catch (const EvalLimitError& error)
+		{
+			Interrupted(error, task.variables(), outcome);
+		}
+
+		return outcome;
+	}
+
+	Environment m_prelude;
+	std::vector<Backend> m_backends;
+};
+
+/*
+食い違いが残る限り AST を小さくしていく。
+候補は、列の要素をひとつ消す・式をその部分式か 1 に置き換える・関数の本体を空にする、の三種類。
+*/
+class FuzzMinimizer
+{
+public:
+
+	FuzzMinimizer(std::function<bool(const Expr&)> failing) :
+		m_failing(failing)
+	{}
+
+	Expr minimize(const Expr& program, int maxAttempts = 2000)
+	{
+		Expr current = program;
+		int attempts = 0;
+
+		for (bool reduced = true; reduced && attempts < maxAttempts;)
+		{
+			reduced = false;
+			for (size_t target = 0; !reduced && attempts < maxAttempts; ++target)
+			{
+				std::vector<Expr> candidates;
+				if (!Candidates(current, target, candidates))
+				{
+					break;
+				}
+
+				for (const auto& candidate : candidates)
+				{
+					++attempts;
+					if (m_failing(candidate))
+					{
+						current = candidate;
+						reduced = true;
+						break;
+					}
+				}
+			}
+		}
+
+		return current;
+	}
+
+private:
+
+	/*
+	前順で target 番目のノードを置き換えた木を candidates に加える。target 番目のノードがなければ false。
+	*/
+	static bool Candidates(const Expr& root, size_t target, std::vector<Expr>& candidates)
+	{
+		Rewriter rewriter(target);
+		const std::vector<Expr> results = boost::apply_visitor(rewriter, root);
+		candidates.insert(candidates.end(), results.begin(), results.end());
+		return rewriter.found();
+	}
+
+	class Rewriter : public boost::static_visitor<std::vector<Expr>>
+	{
+	public:
+
+		Rewriter(size_t target) :
+			m_target(target)
+		{}
+
+		bool found()const
+		{
+			return m_index > m_target;
+		}
+
+		template <class T>
+		std::vector<Expr> operator()(const T& node)
+		{
+			const bool self = m_index++ == m_target;
+			std::vector<Expr> results;
+
+			if (self)
+			{
+				replacements(node, results);
+				return results;
+			}
+
+			return children(node);
+		}
+
+	private:
+
+		static bool Replaceable(const Expr& expr)
+		{
+			return !SameType(expr.type(), typeid(Lines))
+				&& !SameType(expr.type(), typeid(Statement))
+				&& !SameType(expr.type(), typeid(UnaryExpr<Add>))
+				&& !SameType(expr.type(), typeid(CallFunc));
+		}
+
+		template <class T>
+		void replacements(const T&, std::vector<Expr>&)
+		{}
+
+		void replacements(double node, std::vector<Expr>& results)
+		{
+			results.push_back(static_cast<int>(node));
+		}
+
+		void replacements(int node, std::vector<Expr>& results)
+		{
+			if (node != 0 && node != 1)
+			{
+				results.push_back(1);
+			}
+		}
+
+		template <class Op>
+		void replacements(const UnaryExpr<Op>& node, std::vector<Expr>& results)
+		{
+			if (Replaceable(node.lhs))
+			{
+				results.push_back(node.lhs);
+			}
+			results.push_back(1);
+		}
+
+		template <class Op>
+		void replacements(const BinaryExpr<Op>& node, std::vector<Expr>& results)
+		{
+			if (Replaceable(node.lhs))
+			{
+				results.push_back(node.lhs);
+			}
+			if (Replaceable(node.rhs))
+			{
+				results.push_back(node.rhs);
+			}
+			results.push_back(1);
+		}
+
+		void replacements(const BinaryExpr<Assign>& node, std::vector<Expr>& results)
+		{
+			if (!SameType(node.rhs.type(), typeid(int)))
+			{
+				results.push_back(BinaryExpr<Assign>(node.lhs, 1));
+			}
+		}
+
+		void replacements(const DefFunc& node, std::vector<Expr>& results)
+		{
+			if (!SameType(node.expr->type(), typeid(int)))
+			{
+				results.push_back(DefFunc(node.arguments, Expr()));
+			}
+		}
+
+		void replacements(const CallFunc& node, std::vector<Expr>& results)
+		{
+			results.push_back(1);
+			for (const auto& argument : node.actualArguments)
+			{
+				results.push_back(argument);
+			}
+		}
+
+		void replacements(const Lines& node, std::vector<Expr>& results)
+		{
+			for (size_t i = 0; node.exprs.size() > 1 && i < node.exprs.size(); ++i)
+			{
+				Lines smaller;
+				for (size_t j = 0; j < node.exprs.size(); ++j)
+				{
+					if (j != i)
+					{
+						smaller.add(node.exprs[j]);
+					}
+				}
+				results.push_back(smaller);
+			}
+		}
+
+		/*
+		子の中で置き換えが起きたら、その子を差し替えた自分を返す。
+		*/
+		template <class T>
+		std::vector<Expr> children(const T&)
+		{
+			return {};
+		}
+
+		template <class Op>
+		std::vector<Expr> children(const UnaryExpr<Op>& node)
+		{
+			std::vector<Expr> results;
+			for (const auto& lhs : boost::apply_visitor(*this, node.lhs))
+			{
+				results.push_back(UnaryExpr<Op>(lhs));
+			}
+			return results;
+		}
+
+		template <class Op>
+		std::vector<Expr> children(const BinaryExpr<Op>& node)
+		{
+			std::vector<Expr> results;
+			for (const auto& lhs : boost::apply_visitor(*this, node.lhs))
+			{
+				results.push_back(BinaryExpr<Op>(lhs, node.rhs));
+			}
+			for (const auto& rhs : boost::apply_visitor(*this, node.rhs))
+			{
+				results.push_back(BinaryExpr<Op>(node.lhs, rhs));
+			}
+			return results;
+		}
+
+		std::vector<Expr> children(const DefFunc& node)
+		{
+			std::vector<Expr> results;
+			for (const auto& body : boost::apply_visitor(*this, *node.expr))
+			{
+				results.push_back(DefFunc(node.arguments, body));
+			}
+			return results;
+		}
+
+		std::vector<Expr> children(const CallFunc& node)
+		{
+			std::vector<Expr> results;
+			for (size_t i = 0; i < node.actualArguments.size(); ++i)
+			{
+				for (const auto& argument : boost::apply_visitor(*this, node.actualArguments[i]))
+				{
+					std::vector<Expr> arguments(node.actualArguments);
+					arguments[i] = argument;
+					results.push_back(CallFunc(node.funcRef, arguments));
+				}
+			}
+			return results;
+		}
+
+		std::vector<Expr> children(const Lines& node)
+		{
+			std::vector<Expr> results;
+			for (size_t i = 0; i < node.exprs.size(); ++i)
+			{
+				for (const auto& element : boost::apply_visitor(*this, node.exprs[i]))
+				{
+					Lines changed;
+					changed.exprs = node.exprs;
+					changed.exprs[i] = element;
+					results.push_back(changed);
+				}
+			}
+			return results;
+		}
+
+		size_t m_target;
+		size_t m_index = 0;
+	};
+
+	std::function<bool(const Expr&)> m_failing;
+};
+
+struct FuzzOptions
+{
+	int cases = 500;
+	unsigned seed = 1;
+
+	/*
+	true なら名前・代入・呼び出しも含める（ソースを経由しない）。
+	*/
+	bool variables = false;
+
+	/*
+	文法だけのモードでソースから AST を作る関数（sample.y の parse）
+	*/
+	std::function<bool(const std::string&, Lines*)> parse;
+
+	/*
+	生成したプログラムの前に必ず試すプログラム（過去に見つかった食い違いなど）
+	*/
+	std::vector<Lines> corpus;
+};
+
+/*
+以前に経路の食い違いを起こしたプログラム
+*/
+inline std::vector<Lines> FuzzRegressions()
+{
+	const Identifer a("a"), b("b"), f("f"), g("g"), x("x"), y("y");
+
+	/*
+	遅延された a*2 が、後の引数 g(100) の中の代入で g の引数 a を見て評価されていた。
+	a = 2, f = (x, y)->(x + 0), g = (a)->(b = 5, a + 0), f(a*2, g(100))
+	*/
+	Lines shadowedArgument;
+	shadowedArgument.add(BinaryExpr<Assign>(a, 2));
+	shadowedArgument.add(BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x, y }), BinaryExpr<Add>(x, 0))));
+	Lines body;
+	body.add(BinaryExpr<Assign>(b, 5));
+	body.add(BinaryExpr<Add>(a, 0));
+	shadowedArgument.add(BinaryExpr<Assign>(g, DefFunc(std::vector<Identifer>({ a }), body)));
+	shadowedArgument.add(CallFunc(f, { BinaryExpr<Mul>(a, 2), CallFunc(g, { 100 }) }));
+
+	return { shadowedArgument };
+}
+
+/*
+program が基準の評価と食い違っていれば、最小化して表示して true を返す。
+*/
+inline bool reportMismatch(DifferentialRunner& runner, const Expr& program, const std::string& label, const std::string& source)
+{
+	const std::string backend = runner.mismatch(program);
+	if (backend.empty())
+	{
+		return false;
+	}
+
+	FuzzMinimizer minimizer([&](const Expr& candidate) { return runner.mismatch(candidate) == backend; });
+	const Expr minimized = minimizer.minimize(program);
+
+	std::cout << "Fuzz mismatch (" << label << ", backend " << backend << "):\n";
+	if (!source.empty())
+	{
+		std::cout << source << "\n";
+	}
+	printExpr(minimized);
+	std::cout << "\n";
+
+	const FuzzOutcome expected = runner.reference(minimized);
+	std::cout << "  reference: " << expected.result << " | " << expected.variables << "\n";
+	for (const auto& each : runner.backends())
+	{
+		if (each.name == backend)
+		{
+			const FuzzOutcome actual = each.run(minimized);
+			std::cout << "  " << backend << ": " << actual.result << " | " << actual.variables << "\n";
+		}
+	}
+
+	return true;
+}
+
+/*
+基準の評価と食い違ったプログラムの数を返す（corpus の分も含む）。食い違いは最小化して表示する。
+構文解析に失敗したソースも生成器と文法の食い違いとして数える。
+*/
+inline int differentialFuzz(const FuzzOptions& options)
+{
+	DifferentialRunner runner;
+	int wrongs = 0;
+
+	for (size_t i = 0; i < options.corpus.size(); ++i)
+	{
+		if (reportMismatch(runner, options.corpus[i], "corpus " + std::to_string(i), ""))
+		{
+			++wrongs;
+		}
+	}
+
+	for (int i = 0; i < options.cases; ++i)
+	{
+		FuzzChoices choices(options.seed + i);
+		Lines program = ProgramGenerator(choices, options.variables).program();
+
+		std::string source;
+		if (!options.variables && options.parse)
+		{
+			source = ToSource(program);
+
+			Lines parsed;
+			/* 構文規則の中のデバッグ出力も止める */
+			std::streambuf* errBuf = std::cerr.rdbuf(nullptr);
+			std::streambuf* outBuf = std::cout.rdbuf(nullptr);
+			const bool succeed = options.parse(source, &parsed);
+			std::cout.rdbuf(outBuf);
+			std::cout.clear();
+			std::cerr.rdbuf(errBuf);
+			std::cerr.clear();
+
+			if (!succeed)
+			{
+				std::cout << "Fuzz parse failure (seed " << options.seed + i << "):\n" << source << "\n";
+				++wrongs;
+				continue;
+			}
+			program = parsed;
+		}
+
+		if (reportMismatch(runner, program, "seed " + std::to_string(options.seed + i), source))
+		{
+			++wrongs;
+		}
+	}
+
+	return wrongs;
+}
@@ -0,0 +1,405 @@
+#pragma once
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "Node.hpp"
+
+/*
+同じ形の部分木をひとつの SharedNode にまとめ、AST を DAG にする。
+副作用のない共有部分木は、評価時に変数の見え方が変わるまで一度だけ評価される（Eval の SharedExpr を参照）。
+*/
+
+struct HashConsReport
+{
+	size_t nodesBefore = 0;
+	size_t nodesAfter = 0;
+	size_t bytesBefore = 0;
+	size_t bytesAfter = 0;
+	size_t sharedNodes = 0;
+};
+
+/*
+AST のノード数とおおよそのメモリ量（共有されたノードは一度だけ数える）
+*/
+class AstSize : public boost::static_visitor<void>
+{
+public:
+
+	size_t nodes = 0;
+	size_t bytes = sizeof(Expr);
+
+	void operator()(int)
+	{
+		++nodes;
+	}
+
+	void operator()(double)
+	{
+		++nodes;
+	}
+
+	void operator()(const Identifer& node)
+	{
+		++nodes;
+		bytes += stringBytes(node.name);
+	}
+
+	void operator()(const SharedExpr& node)
+	{
+		if (m_visited.insert(node.node.get()).second)
+		{
+			bytes += sizeof(SharedNode) + ControlBlockBytes;
+			boost::apply_visitor(*this, node.node->expr);
+		}
+	}
+
+	template <class Op>
+	void operator()(const UnaryExpr<Op>& node)
+	{
+		++nodes;
+		bytes += sizeof(node);
+		boost::apply_visitor(*this, node.lhs);
+	}
+
+	template <class Op>
+	void operator()(const BinaryExpr<Op>& node)
+	{
+		++nodes;
+		bytes += sizeof(node);
+		boost::apply_visitor(*this, node.lhs);
+		boost::apply_visitor(*this, node.rhs);
+	}
+
+	void operator()(const DefFunc& node)
+	{
+		++nodes;
+		bytes += sizeof(node) + node.arguments.capacity() * sizeof(Identifer) + sizeof(Expr) + ControlBlockBytes;
+		for (const auto& argument : node.arguments)
+		{
+			bytes += stringBytes(argument.name);
+		}
+		boost::apply_visitor(*this, *node.expr);
+	}
+
+	void operator()(const CallFunc& node)
+	{
+		++nodes;
+		bytes += sizeof(node);
+		visit(node.actualArguments);
+	}
+
+	void operator()(const Statement& node)
+	{
+		++nodes;
+		bytes += sizeof(node);
+		visit(node.exprs);
+	}
+
+	void operator()(const Lines& node)
+	{
+		++nodes;
+		bytes += sizeof(node);
+		visit(node.exprs);
+	}
+
+private:
+
+	static const size_t ControlBlockBytes = 2 * sizeof(void*);
+
+	static size_t stringBytes(const std::string& str)
+	{
+		return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+	}
+
+	void visit(const std::vector<Expr>& exprs)
+	{
+		bytes += exprs.capacity() * sizeof(Expr);
+		for (const auto& expr : exprs)
+		{
+			boost::apply_visitor(*this, expr);
+		}
+	}
+
+	std::set<const void*> m_visited;
+};
+
+inline AstSize MeasureAst(const Expr& expr)
+{
+	AstSize size;
+	boost::apply_visitor(size, expr);
+	return size;
+}
+
+class HashConser
+{
+public:
+
+	Expr run(const Expr& expr, HashConsReport* report = nullptr)
+	{
+		Interner interner(*this);
+		boost::apply_visitor(interner, expr);
+
+		Rebuilder rebuilder(*this);
+		const Expr result = boost::apply_visitor(rebuilder, expr);
+
+		if (report)
+		{
+			const AstSize before = MeasureAst(expr);
+			const AstSize after = MeasureAst(result);
+			report->nodesBefore = before.nodes;
+			report->bytesBefore = before.bytes;
+			report->nodesAfter = after.nodes;
+			report->bytesAfter = after.bytes;
+			report->sharedNodes = m_shared.size();
+		}
+
+		return result;
+	}
+
+	/*
+	共有した部分木の評価結果を使い回した回数
+	*/
+	size_t memoHits()const
+	{
+		size_t hits = 0;
+		for (const auto& shared : m_shared)
+		{
+			hits += shared.second->hits;
+		}
+		return hits;
+	}
+
+private:
+
+	/*
+	子の番号と自身の種類から部分木の番号を決める（同じ形なら同じ番号）。
+	*/
+	class Interner : public boost::static_visitor<size_t>
+	{
+	public:
+
+		Interner(HashConser& owner) :
+			m_owner(owner)
+		{}
+
+		size_t operator()(int node)
+		{
+			return m_owner.leaf("i" + std::to_string(node));
+		}
+
+		size_t operator()(double node)
+		{
+			unsigned long long bits = 0;
+			std::memcpy(&bits, &node, sizeof(node));
+			return m_owner.leaf("d" + std::to_string(bits));
+		}
+
+		size_t operator()(const Identifer& node)
+		{
+			return m_owner.leaf("n" + node.name);
+		}
+
+		size_t operator()(const SharedExpr& node)
+		{
+			return boost::apply_visitor(*this, node.node->expr);
+		}
+
+		template <class Op>
+		size_t operator()(const UnaryExpr<Op>& node)
+		{
+			return m_owner.node(&node, "u" + std::string(typeid(node).name()) + key(node.lhs));
+		}
+
+		template <class Op>
+		size_t operator()(const BinaryExpr<Op>& node)
+		{
+			return m_owner.node(&node, "b" + std::string(typeid(node).name()) + key(node.lhs) + key(node.rhs));
+		}
+
+		size_t operator()(const DefFunc& node)
+		{
+			std::string str = "f";
+			for (const auto& argument : node.arguments)
+			{
+				str += std::to_string(argument.name.size()) + ":" + argument.name;
+			}
+			return m_owner.node(&node, str + key(*node.expr));
+		}
+
+		size_t operator()(const CallFunc& node)
+		{
+			std::string str = "c";
+			if (SameType(node.funcRef.type(), typeid(Identifer)))
+			{
+				const auto& name = boost::get<Identifer>(node.funcRef).name;
+				str += std::to_string(name.size()) + ":" + name;
+			}
+			else
+			{
+				str += "#" + std::to_string(boost::get<FuncVal>(node.funcRef).data->id);
+			}
+			return m_owner.node(&node, str + keys(node.actualArguments));
+		}
+
+		size_t operator()(const Statement& node)
+		{
+			return m_owner.node(&node, "s" + keys(node.exprs));
+		}
+
+		size_t operator()(const Lines& node)
+		{
+			return m_owner.node(&node, "l" + keys(node.exprs));
+		}
+
+	private:
+
+		std::string key(const Expr& expr)
+		{
+			return "(" + std::to_string(boost::apply_visitor(*this, expr)) + ")";
+		}
+
+		std::string keys(const std::vector<Expr>& exprs)
+		{
+			std::string str = std::to_string(exprs.size());
+			for (const auto& expr : exprs)
+			{
+				str += key(expr);
+			}
+			return str;
+		}
+
+		HashConser& m_owner;
+	};
+
+	/*
+	二回以上現れる部分木を SharedExpr に置き換えながら AST を作り直す。
+	*/
+	class Rebuilder : public boost::static_visitor<Expr>
+	{
+	public:
+
+		Rebuilder(HashConser& owner) :
+			m_owner(owner)
+		{}
+
+		Expr operator()(int node)
+		{
+			return node;
+		}
+
+		Expr operator()(double node)
+		{
+			return node;
+		}
+
+		Expr operator()(const Identifer& node)
+		{
+			return node;
+		}
+
+		Expr operator()(const SharedExpr& node)
+		{
+			return node;
+		}
+
+		template <class Op>
+		Expr operator()(const UnaryExpr<Op>& node)
+		{
+			return share(&node, [&]() -> Expr { return UnaryExpr<Op>(rebuild(node.lhs)); });
+		}
+
+		template <class Op>
+		Expr operator()(const BinaryExpr<Op>& node)
+		{
+			return share(&node, [&]() -> Expr { return BinaryExpr<Op>(rebuild(node.lhs), rebuild(node.rhs)); });
+		}
+
+		Expr operator()(const DefFunc& node)
+		{
+			return share(&node, [&]() -> Expr { return DefFunc(node.arguments, rebuild(*node.expr)); });
+		}
+
+		Expr operator()(const CallFunc& node)
+		{
+			return share(&node, [&]() -> Expr { return CallFunc(node.funcRef, rebuild(node.actualArguments)); });
+		}
+
+		Expr operator()(const Statement& node)
+		{
+			return share(&node, [&]() -> Expr { return Statement(rebuild(node.exprs)); });
+		}
+
+		Expr operator()(const Lines& node)
+		{
+			return share(&node, [&]() -> Expr { return Lines(rebuild(node.exprs)); });
+		}
+
+	private:
+
+		template <class Build>
+		Expr share(const void* address, Build build)
+		{
+			const size_t id = m_owner.m_ids.at(address);
+
+			if (m_owner.m_counts[id] < 2)
+			{
+				return build();
+			}
+
+			auto it = m_owner.m_shared.find(id);
+			if (it == m_owner.m_shared.end())
+			{
+				const Expr expr = build();
+				it = m_owner.m_shared.emplace(id, std::make_shared<const SharedNode>(expr, isPureExpr(expr))).first;
+			}
+
+			return SharedExpr(it->second);
+		}
+
+		Expr rebuild(const Expr& expr)
+		{
+			return boost::apply_visitor(*this, expr);
+		}
+
+		std::vector<Expr> rebuild(const std::vector<Expr>& exprs)
+		{
+			std::vector<Expr> result;
+			result.reserve(exprs.size());
+			for (const auto& expr : exprs)
+			{
+				result.push_back(rebuild(expr));
+			}
+			return result;
+		}
+
+		HashConser& m_owner;
+	};
+
+	size_t leaf(const std::string& key)
+	{
+		return m_keys.emplace(key, m_keys.size()).first->second;
+	}
+
+	size_t node(const void* address, const std::string& key)
+	{
+		const size_t id = leaf(key);
+		m_ids[address] = id;
+		++m_counts[id];
+		return id;
+	}
+
+	std::map<std::string, size_t> m_keys;
+	std::map<const void*, size_t> m_ids;
+	std::map<size_t, size_t> m_counts;
+	std::map<size_t, std::shared_ptr<const SharedNode>> m_shared;
+};
+
+/*
+hash-consing を行った AST を返す。report を渡すとノード数とメモリ量の変化を書き込む。
+*/
+inline Expr hashConsExpr(const Expr& expr, HashConsReport* report = nullptr)
+{
+	return HashConser().run(expr, report);
+}
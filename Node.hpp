@@ -4,8 +4,15 @@
 #include <functional>
 #include <iostream>
 #include <map>
+#include <chrono>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <boost/variant.hpp>
 #include <boost/optional.hpp>
+#include "Telemetry.hpp"
 
 template<class T1, class T2>
 inline bool SameType(const T1& t1, const T2& t2)
@@ -35,6 +42,24 @@ struct Identifer
 
 struct FuncVal;
 
+struct Thunk;
+
+struct SharedNode;
+
+/*
+同じ形の部分木を共有するためのノード（HashCons.hpp で作られる）
+*/
+struct SharedExpr
+{
+	std::shared_ptr<const SharedNode> node;
+
+	SharedExpr() = default;
+
+	SharedExpr(const std::shared_ptr<const SharedNode>& node_) :
+		node(node_)
+	{}
+};
+
 struct CallFunc;
 
 template <class Op>
@@ -50,6 +75,7 @@ using Expr = boost::variant<
 	int,
 	double,
 	Identifer,
+	SharedExpr,
 	boost::recursive_wrapper<Statement>,
 	boost::recursive_wrapper<Lines>,
 	boost::recursive_wrapper<DefFunc>,
@@ -80,31 +106,457 @@ struct ExprHolder
 
 void printExpr(const Expr& expr);
 
-using Evaluated = boost::variant<
-	int,
-	double,
-	Identifer,
-	boost::recursive_wrapper<FuncVal>
->;
+/*
+評価結果の値
+boost::variant<int, double, Identifer, FuncVal, Thunk> と同じ値を 16 バイトで表す。
+int と double はそのまま持ち、名前・関数・遅延された引数は参照カウント付きのヒープ領域を指すので、コピーはカウントの増減だけで済む。
+*/
+class Evaluated
+{
+public:
+
+	Evaluated() :
+		m_tag(Tag::Int)
+	{
+		m_payload.i = 0;
+	}
+
+	Evaluated(int value) :
+		m_tag(Tag::Int)
+	{
+		m_payload.i = value;
+	}
+
+	Evaluated(double value) :
+		m_tag(Tag::Double)
+	{
+		m_payload.d = value;
+	}
+
+	Evaluated(const Identifer& value);
+	Evaluated(const FuncVal& value);
+	Evaluated(const Thunk& value);
+
+	Evaluated(const Evaluated& other) :
+		m_payload(other.m_payload),
+		m_tag(other.m_tag)
+	{
+		retain();
+	}
+
+	Evaluated(Evaluated&& other) noexcept :
+		m_payload(other.m_payload),
+		m_tag(other.m_tag)
+	{
+		other.m_tag = Tag::Int;
+		other.m_payload.i = 0;
+	}
+
+	Evaluated& operator=(const Evaluated& other)
+	{
+		Evaluated copy(other);
+		swap(copy);
+		return *this;
+	}
+
+	Evaluated& operator=(Evaluated&& other) noexcept
+	{
+		Evaluated moved(std::move(other));
+		swap(moved);
+		return *this;
+	}
+
+	~Evaluated()
+	{
+		release();
+	}
 
-extern std::map<std::string, Evaluated> globalVariables;
-extern std::map<std::string, Evaluated> localVariables;
+	void swap(Evaluated& other) noexcept
+	{
+		std::swap(m_payload, other.m_payload);
+		std::swap(m_tag, other.m_tag);
+	}
+
+	const std::type_info& type()const;
+
+	template <class T>
+	bool is()const
+	{
+		return m_tag == TagOf<T>::value;
+	}
+
+	/*
+	boost::get と同じく、型が違えば boost::bad_get を投げる。
+	*/
+	template <class T>
+	const T& get()const
+	{
+		if (!is<T>())
+		{
+			throw boost::bad_get();
+		}
+		return Access<T>::get(*this);
+	}
 
-inline boost::optional<std::map<std::string, Evaluated>::iterator> findVariable(const std::string& variableName)
+private:
+
+	enum class Tag : std::uint32_t
+	{
+		Int,
+		Double,
+		Identifer,
+		FuncVal,
+		Thunk
+	};
+
+	template <class T> struct TagOf;
+	template <class T> struct Access;
+
+	struct Cell
+	{
+		std::atomic<std::uint32_t> count;
+
+		Cell() :
+			count(1)
+		{}
+	};
+
+	template <class T>
+	struct Box : Cell
+	{
+		T value;
+
+		Box(const T& value_) :
+			value(value_)
+		{}
+	};
+
+	template <class T>
+	static const T& unbox(const Cell* cell)
+	{
+		return static_cast<const Box<T>*>(cell)->value;
+	}
+
+	bool isBoxed()const
+	{
+		return m_tag != Tag::Int && m_tag != Tag::Double;
+	}
+
+	void retain()
+	{
+		if (isBoxed())
+		{
+			m_payload.cell->count.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	void release();
+
+	union Payload
+	{
+		int i;
+		double d;
+		Cell* cell;
+	};
+
+	Payload m_payload;
+	Tag m_tag;
+};
+
+static_assert(sizeof(Evaluated) <= 16, "Evaluated must stay within 16 bytes");
+
+/*
+変数環境
+書き込みは手元の std::map に入り、fork するとそれを共有の読み取り専用の層に移して上に空の層を重ねる。
+fork と破棄は環境の大きさによらず定数時間で、層の数は上の層が下の層の半分以上になったら併合して対数に抑える。
+*/
+class Environment
 {
-	std::map<std::string, Evaluated>::iterator itLocal = localVariables.find(variableName);
-	if (itLocal != localVariables.end())
+public:
+
+	Environment() = default;
+
+	const Evaluated* find(const std::string& name)const
+	{
+		const auto it = m_variables.find(name);
+		if (it != m_variables.end())
+		{
+			return &it->second;
+		}
+
+		return findFrozen(name);
+	}
+
+	void assign(const std::string& name, const Evaluated& value)
+	{
+		const auto it = m_variables.find(name);
+		if (it != m_variables.end())
+		{
+			it->second = value;
+			return;
+		}
+
+		if (!findFrozen(name))
+		{
+			++m_size;
+		}
+		m_variables.emplace(name, value);
+	}
+
+	/*
+	この時点の内容を持つ別の環境を返す。以降の書き込みは互いに見えない。
+	書きかけの内容を共有の層に移すのでこの環境自体も変更される（同じ環境を複数のスレッドから同時に fork しないこと）。
+	*/
+	Environment fork()
+	{
+		freeze();
+
+		Environment forked;
+		forked.m_frozen = m_frozen;
+		forked.m_size = m_size;
+		return forked;
+	}
+
+	size_t size()const
+	{
+		return m_size;
+	}
+
+	bool empty()const
 	{
-		return itLocal;
+		return m_size == 0;
 	}
 
-	std::map<std::string, Evaluated>::iterator itGlobal = globalVariables.find(variableName);
-	if (itGlobal != globalVariables.end())
+	void clear()
+	{
+		m_variables.clear();
+		m_frozen.reset();
+		m_size = 0;
+	}
+
+	void swap(Environment& other)
+	{
+		m_variables.swap(other.m_variables);
+		m_frozen.swap(other.m_frozen);
+		std::swap(m_size, other.m_size);
+	}
+
+private:
+
+	struct Layer
+	{
+		std::map<std::string, Evaluated> variables;
+		std::shared_ptr<const Layer> parent;
+	};
+
+	const Evaluated* findFrozen(const std::string& name)const
+	{
+		for (const Layer* layer = m_frozen.get(); layer; layer = layer->parent.get())
+		{
+			const auto it = layer->variables.find(name);
+			if (it != layer->variables.end())
+			{
+				return &it->second;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void freeze()
+	{
+		if (m_variables.empty())
+		{
+			return;
+		}
+
+		auto layer = std::make_shared<Layer>();
+		layer->variables = std::move(m_variables);
+		layer->parent = m_frozen;
+		m_variables.clear();
+
+		while (layer->parent && layer->parent->variables.size() <= 2 * layer->variables.size())
+		{
+			layer->variables.insert(layer->parent->variables.begin(), layer->parent->variables.end());
+			layer->parent = layer->parent->parent;
+		}
+
+		m_frozen = std::move(layer);
+	}
+
+	std::map<std::string, Evaluated> m_variables;
+	std::shared_ptr<const Layer> m_frozen;
+	size_t m_size = 0;
+};
+
+struct FuncValData;
+
+/*
+関数値は不変な共有ハンドルとして扱う。
+コピーは参照カウントの増減だけで済み、キャプチャした環境と本体の AST は共有される。
+*/
+struct FuncVal
+{
+	std::shared_ptr<const FuncValData> data;
+
+	FuncVal() = default;
+
+	FuncVal(
+		const Environment& environment_,
+		const std::vector<Identifer>& arguments_,
+		const std::shared_ptr<const Expr>& expr_);
+
+	const Environment& environment()const;
+	const std::vector<Identifer>& arguments()const;
+	const Expr& expr()const;
+};
+
+struct ThunkData;
+
+/*
+遅延評価される引数
+最初に値が必要になったときに一度だけ評価され、以降はその値を返す。
+*/
+struct Thunk
+{
+	std::shared_ptr<ThunkData> data;
+
+	Thunk() = default;
+
+	Thunk(const std::shared_ptr<ThunkData>& data_) :
+		data(data_)
+	{}
+
+	const Evaluated& force()const;
+};
+
+struct ThunkData
+{
+	std::function<Evaluated()> compute;
+	boost::optional<Evaluated> value;
+
+	ThunkData(const std::function<Evaluated()>& compute_) :
+		compute(compute_)
+	{}
+};
+
+inline const Evaluated& Thunk::force()const
+{
+	if (!data->value)
+	{
+		const auto compute = std::move(data->compute);
+		data->value = compute();
+	}
+
+	return data->value.get();
+}
+
+template <> struct Evaluated::TagOf<int> { static const Tag value = Tag::Int; };
+template <> struct Evaluated::TagOf<double> { static const Tag value = Tag::Double; };
+template <> struct Evaluated::TagOf<Identifer> { static const Tag value = Tag::Identifer; };
+template <> struct Evaluated::TagOf<FuncVal> { static const Tag value = Tag::FuncVal; };
+template <> struct Evaluated::TagOf<Thunk> { static const Tag value = Tag::Thunk; };
+
+template <> struct Evaluated::Access<int>
+{
+	static const int& get(const Evaluated& v) { return v.m_payload.i; }
+};
+
+template <> struct Evaluated::Access<double>
+{
+	static const double& get(const Evaluated& v) { return v.m_payload.d; }
+};
+
+template <class T> struct Evaluated::Access
+{
+	static const T& get(const Evaluated& v) { return unbox<T>(v.m_payload.cell); }
+};
+
+inline Evaluated::Evaluated(const Identifer& value) :
+	m_tag(Tag::Identifer)
+{
+	m_payload.cell = new Box<Identifer>(value);
+}
+
+inline Evaluated::Evaluated(const FuncVal& value) :
+	m_tag(Tag::FuncVal)
+{
+	m_payload.cell = new Box<FuncVal>(value);
+}
+
+inline Evaluated::Evaluated(const Thunk& value) :
+	m_tag(Tag::Thunk)
+{
+	m_payload.cell = new Box<Thunk>(value);
+}
+
+inline void Evaluated::release()
+{
+	if (!isBoxed() || m_payload.cell->count.fetch_sub(1, std::memory_order_acq_rel) != 1)
+	{
+		return;
+	}
+
+	switch (m_tag)
+	{
+	case Tag::Identifer: delete static_cast<Box<Identifer>*>(m_payload.cell); break;
+	case Tag::FuncVal:   delete static_cast<Box<FuncVal>*>(m_payload.cell); break;
+	case Tag::Thunk:     delete static_cast<Box<Thunk>*>(m_payload.cell); break;
+	default: break;
+	}
+}
+
+inline const std::type_info& Evaluated::type()const
+{
+	switch (m_tag)
+	{
+	case Tag::Int:       return typeid(int);
+	case Tag::Double:    return typeid(double);
+	case Tag::Identifer: return typeid(Identifer);
+	case Tag::FuncVal:   return typeid(FuncVal);
+	default:             return typeid(Thunk);
+	}
+}
+
+/*
+変数の値を参照するときは遅延された引数をここで評価する。
+*/
+inline const Evaluated& Force(const Evaluated& value)
+{
+	if (value.is<Thunk>())
+	{
+		return value.get<Thunk>().force();
+	}
+
+	return value;
+}
+
+extern Environment globalVariables;
+extern Environment localVariables;
+
+/*
+関数を指していた大域変数が代入で書き換えられるたびに増える番号
+*/
+extern size_t bindingVersion;
+
+/*
+現在のローカル変数の元になった関数（最上位では nullptr）
+*/
+extern const FuncValData* currentScope;
+
+/*
+変数の見え方が変わる（代入・ローカル変数の切り替え）たびに増える番号
+*/
+extern size_t variablesVersion;
+
+inline const Evaluated* findVariable(const std::string& variableName)
+{
+	if (const Evaluated* local = localVariables.find(variableName))
 	{
-		return itGlobal;
+		return local;
 	}
 
-	return boost::none;
+	return globalVariables.find(variableName);
 }
 
 template <class Op>
@@ -162,126 +614,560 @@ struct Lines
 		exprs(exprs_)
 	{}
 
-	void add(const Expr& expr)
+	void add(const Expr& expr)
+	{
+		exprs.push_back(expr);
+	}
+
+	void add(Expr&& expr)
+	{
+		exprs.push_back(std::move(expr));
+	}
+
+	void concat(const Lines& lines)
+	{
+		exprs.insert(exprs.end(), lines.exprs.begin(), lines.exprs.end());
+	}
+
+	void reverse()
+	{
+		std::reverse(exprs.begin(), exprs.end());
+	}
+
+	Lines& operator+=(const Lines& lines)
+	{
+		exprs.insert(exprs.end(), lines.exprs.begin(), lines.exprs.end());
+		return *this;
+	}
+};
+
+struct Arguments
+{
+	std::vector<Identifer> arguments;
+
+	Arguments() = default;
+
+	Arguments(const Identifer& identifer):
+		arguments({ identifer })
+	{}
+
+	void concat(const Arguments& other)
+	{
+		arguments.insert(arguments.end(), other.arguments.begin(), other.arguments.end());
+	}
+
+	Arguments& operator+=(const Arguments& other)
+	{
+		arguments.insert(arguments.end(), other.arguments.begin(), other.arguments.end());
+		return *this;
+	}
+};
+
+/*
+関数値ごとに異なる番号（アドレスと違って再利用されない）
+*/
+inline size_t NextFuncValId()
+{
+	static std::atomic<size_t> next(1);
+	return next++;
+}
+
+struct FuncValData
+{
+	Environment environment;
+	std::vector<Identifer> arguments;
+	std::shared_ptr<const Expr> expr;
+	size_t id;
+
+	FuncValData(
+		const Environment& environment_,
+		const std::vector<Identifer>& arguments_,
+		const std::shared_ptr<const Expr>& expr_) :
+		environment(environment_),
+		arguments(arguments_),
+		expr(expr_),
+		id(NextFuncValId())
+	{}
+};
+
+inline FuncVal::FuncVal(
+	const Environment& environment_,
+	const std::vector<Identifer>& arguments_,
+	const std::shared_ptr<const Expr>& expr_) :
+	data(std::make_shared<const FuncValData>(environment_, arguments_, expr_))
+{}
+
+inline const Environment& FuncVal::environment()const
+{
+	return data->environment;
+}
+
+inline const std::vector<Identifer>& FuncVal::arguments()const
+{
+	return data->arguments;
+}
+
+inline const Expr& FuncVal::expr()const
+{
+	return *data->expr;
+}
+
+struct DefFunc
+{
+	std::vector<Identifer> arguments;
+	std::shared_ptr<const Expr> expr;
+
+	DefFunc() :
+		expr(std::make_shared<const Expr>())
+	{}
+
+	DefFunc(const Expr& expr_) :
+		expr(std::make_shared<const Expr>(expr_))
+	{}
+
+	DefFunc(
+		const std::vector<Identifer>& arguments_,
+		const Expr& expr_) :
+		arguments(arguments_),
+		expr(std::make_shared<const Expr>(expr_))
+	{}
+
+	DefFunc(
+		const Arguments& arguments_,
+		const Expr& expr_) :
+		arguments(arguments_.arguments),
+		expr(std::make_shared<const Expr>(expr_))
+	{}
+};
+
+inline FuncVal GetFuncVal(const Identifer& funcName)
+{
+	const Evaluated* funcPtr = findVariable(funcName.name);
+
+	if (!funcPtr)
+	{
+		std::cerr << "Error(" << __LINE__ << "): function \"" << funcName.name << "\" was not found." << "\n";
+	}
+
+	const Evaluated& funcRef = Force(*funcPtr);
+
+	if (!funcRef.is<FuncVal>())
+	{
+		std::cerr << "Error(" << __LINE__ << "): function \"" << funcName.name << "\" is not a function." << "\n";
+	}
+
+	return funcRef.get<FuncVal>();
+}
+
+struct InlineCacheStats
+{
+	size_t hits = 0;
+	size_t misses = 0;
+};
+
+extern InlineCacheStats inlineCacheStats;
+
+/*
+呼び出し箇所ごとに、名前から引いた関数を覚えておくキャッシュ
+関数の中のローカル変数は引数を除いて関数ごとに決まり、大域変数の関数は代入でしか変わらないので、
+(現在の関数, bindingVersion) が同じなら同じ関数が引ける。
+ほとんどの呼び出し箇所は先頭の要素だけで当たり、同じ本体を共有する複数の関数から呼ばれる場合に残りの要素を使う。
+覚えた関数は束縛が生きている間しか使わないので、関数の本体との循環参照にならないよう弱参照で持つ。
+*/
+struct CallSiteCache
+{
+	static const size_t MaxEntries = 4;
+
+	struct Entry
+	{
+		size_t scope = 0;
+		size_t version = 0;
+		std::weak_ptr<const FuncValData> function;
+	};
+
+	Entry entries[MaxEntries];
+	size_t size = 0;
+	size_t next = 0;
+
+	InlineCacheStats stats;
+
+	/*
+	覚えた関数がもう解放されていたら外れとして扱い、その要素を取り除く。
+	*/
+	bool find(size_t scope, size_t version, FuncVal& funcVal)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			if (entries[i].version == version && entries[i].scope == scope)
+			{
+				auto function = entries[i].function.lock();
+				if (!function)
+				{
+					entries[i] = entries[--size];
+					break;
+				}
+
+				++stats.hits;
+				++inlineCacheStats.hits;
+				funcVal.data = std::move(function);
+				return true;
+			}
+		}
+
+		++stats.misses;
+		++inlineCacheStats.misses;
+		return false;
+	}
+
+	void insert(size_t scope, size_t version, const FuncVal& funcVal)
+	{
+		Entry& entry = entries[size < MaxEntries ? size++ : next++ % MaxEntries];
+		entry.scope = scope;
+		entry.version = version;
+		entry.function = funcVal.data;
+	}
+};
+
+struct CallFunc
+{
+	boost::variant<FuncVal, Identifer> funcRef;
+	std::vector<Expr> actualArguments;
+	mutable CallSiteCache cache;
+
+	CallFunc(
+		const FuncVal& funcVal_,
+		const std::vector<Expr>& actualArguments_) :
+		funcRef(funcVal_),
+		actualArguments(actualArguments_)
+	{}
+
+	CallFunc(
+		const Identifer& funcName,
+		const std::vector<Expr>& actualArguments_) :
+		funcRef(funcName),
+		actualArguments(actualArguments_)
+	{}
+
+	CallFunc(
+		const boost::variant<FuncVal, Identifer>& funcRef_,
+		const std::vector<Expr>& actualArguments_) :
+		funcRef(funcRef_),
+		actualArguments(actualArguments_)
+	{}
+};
+
+/*
+共有された部分木
+副作用のない式なら、変数の見え方が変わるまで評価結果を使い回す。
+*/
+struct SharedNode
+{
+	Expr expr;
+	bool pure;
+
+	mutable Evaluated memo;
+	mutable size_t memoVersion = 0;
+	mutable bool hasMemo = false;
+	mutable size_t hits = 0;
+
+	SharedNode(const Expr& expr_, bool pure_) :
+		expr(expr_),
+		pure(pure_)
+	{}
+};
+
+/*
+評価の資源制限
+ステップ数・変数環境のメモリ量・経過時間・関数呼び出しの深さのいずれかを超えたら例外で評価を打ち切る。
+*/
+class EvalLimitError : public std::runtime_error
+{
+public:
+	using std::runtime_error::runtime_error;
+};
+
+class StepLimitExceeded : public EvalLimitError
+{
+public:
+	StepLimitExceeded() :EvalLimitError("evaluation step budget exceeded") {}
+};
+
+class MemoryLimitExceeded : public EvalLimitError
+{
+public:
+	MemoryLimitExceeded() :EvalLimitError("evaluation memory cap exceeded") {}
+};
+
+class TimeLimitExceeded : public EvalLimitError
+{
+public:
+	TimeLimitExceeded() :EvalLimitError("evaluation timed out") {}
+};
+
+class CallDepthExceeded : public EvalLimitError
+{
+public:
+	CallDepthExceeded() :EvalLimitError("evaluation call depth exceeded") {}
+};
+
+class ReferenceCycleDetected : public EvalLimitError
+{
+public:
+	ReferenceCycleDetected() :EvalLimitError("variable references form a cycle") {}
+};
+
+/*
+maxCallDepth だけは既定でも有限にする（無限再帰はステップ予算より先にネイティブのスタックを使い切るため）。
+*/
+struct EvalLimits
+{
+	static const size_t DefaultMaxCallDepth = 1000;
+
+	size_t maxSteps = std::numeric_limits<size_t>::max();
+	size_t maxBytes = std::numeric_limits<size_t>::max();
+	size_t maxCallDepth = DefaultMaxCallDepth;
+	boost::optional<std::chrono::steady_clock::duration> timeout;
+};
+
+class EvalGovernor
+{
+public:
+
+	/*
+	時刻の確認とステップ予算の精算はこのステップ数ごとにまとめて行う。
+	*/
+	static const size_t SliceSteps = 1024;
+
+	EvalGovernor() = default;
+
+	EvalGovernor(const EvalLimits& limits) :
+		m_limits(limits)
+	{
+		if (m_limits.timeout)
+		{
+			m_deadline = std::chrono::steady_clock::now() + m_limits.timeout.get();
+		}
+	}
+
+	/*
+	評価するノードごとに呼ばれる。通常は減算と分岐のみ。
+	*/
+	void step()
+	{
+		if (m_slice == 0)
+		{
+			nextSlice();
+		}
+		--m_slice;
+	}
+
+	void allocate(size_t bytes)
+	{
+		if (m_limits.maxBytes - m_bytes < bytes)
+		{
+			throw MemoryLimitExceeded();
+		}
+		m_bytes += bytes;
+		m_peakBytes = std::max(m_peakBytes, m_bytes);
+	}
+
+	void release(size_t bytes)
 	{
-		exprs.push_back(expr);
+		m_bytes -= std::min(bytes, m_bytes);
 	}
 
-	void concat(const Lines& lines)
+	void enterCall()
 	{
-		exprs.insert(exprs.end(), lines.exprs.begin(), lines.exprs.end());
+		if (m_callDepth == m_limits.maxCallDepth)
+		{
+			throw CallDepthExceeded();
+		}
+		++m_callDepth;
 	}
 
-	Lines& operator+=(const Lines& lines)
+	void leaveCall()
 	{
-		exprs.insert(exprs.end(), lines.exprs.begin(), lines.exprs.end());
-		return *this;
+		--m_callDepth;
 	}
-};
 
-struct Arguments
-{
-	std::vector<Identifer> arguments;
+	size_t callDepth()const
+	{
+		return m_callDepth;
+	}
 
-	Arguments() = default;
+	size_t steps()const
+	{
+		return m_usedSteps + (m_sliceSteps - m_slice);
+	}
 
-	Arguments(const Identifer& identifer):
-		arguments({ identifer })
-	{}
+	size_t bytes()const
+	{
+		return m_bytes;
+	}
 
-	void concat(const Arguments& other)
+	size_t peakBytes()const
 	{
-		arguments.insert(arguments.end(), other.arguments.begin(), other.arguments.end());
+		return m_peakBytes;
 	}
 
-	Arguments& operator+=(const Arguments& other)
+	/*
+	sliceSteps ステップ評価するごとに onSlice を呼ぶ（EvalTask が制御を返すのに使う）。
+	onSlice から投げた例外はそのまま評価を打ち切る。
+	*/
+	void setSliceHandler(size_t sliceSteps, std::function<void()> onSlice)
 	{
-		arguments.insert(arguments.end(), other.arguments.begin(), other.arguments.end());
-		return *this;
+		m_sliceLength = sliceSteps == 0 ? 1 : sliceSteps;
+		m_onSlice = std::move(onSlice);
+	}
+
+private:
+
+	void nextSlice()
+	{
+		m_usedSteps += m_sliceSteps;
+		m_sliceSteps = 0;
+
+		if (m_usedSteps >= m_limits.maxSteps)
+		{
+			throw StepLimitExceeded();
+		}
+
+		if (m_deadline && m_deadline.get() <= std::chrono::steady_clock::now())
+		{
+			throw TimeLimitExceeded();
+		}
+
+		if (m_onSlice && m_usedSteps != 0)
+		{
+			m_onSlice();
+		}
+
+		const size_t remaining = m_limits.maxSteps - m_usedSteps;
+		m_sliceSteps = remaining < m_sliceLength ? remaining : m_sliceLength;
+		m_slice = m_sliceSteps;
 	}
+
+	EvalLimits m_limits;
+	boost::optional<std::chrono::steady_clock::time_point> m_deadline;
+
+	size_t m_slice = 0;
+	size_t m_sliceSteps = 0;
+	size_t m_sliceLength = SliceSteps;
+	size_t m_usedSteps = 0;
+	std::function<void()> m_onSlice;
+
+	size_t m_bytes = 0;
+	size_t m_peakBytes = 0;
+	size_t m_callDepth = 0;
 };
 
-struct FuncVal
+/*
+変数環境のおおよそのメモリ量（要素数に比例する分のみ）
+*/
+inline size_t ApproxEnvironmentBytes(size_t entries)
 {
-	std::map<std::string, Evaluated> environment;
-	std::vector<Identifer> arguments;
-	Expr expr;
-
-	FuncVal() = default;
+	return entries * (sizeof(std::map<std::string, Evaluated>::value_type) + 4 * sizeof(void*));
+}
 
-	FuncVal(
-		const std::map<std::string, Evaluated>& environment_,
-		const std::vector<Identifer>& arguments_,
-		const Expr& expr_) :
-		environment(environment_),
-		arguments(arguments_),
-		expr(expr_)
-	{}
+/*
+遅延された引数を作った時点の呼び出し側の変数環境
+大域変数も fork して持つので、後の代入で引数の値が変わることはない（fork は環境の大きさによらず定数時間）。
+*/
+struct CallerEnvironment
+{
+	Environment globals;
+	Environment locals;
+	const FuncValData* scope;
 };
 
-struct DefFunc
+/*
+関数呼び出しの間だけローカル変数を差し替える。
+評価が途中で打ち切られても呼び出し側の環境に戻す。
+*/
+class LocalVariablesScope
 {
-	std::vector<Identifer> arguments;
-	Expr expr;
+public:
+
+	LocalVariablesScope(EvalGovernor& governor, const FuncVal& funcVal) :
+		m_governor(governor),
+		m_bytes(ApproxEnvironmentBytes(funcVal.arguments().size()))
+	{
+		m_governor.enterCall();
+		try
+		{
+			m_governor.allocate(m_bytes);
+		}
+		catch (...)
+		{
+			m_governor.leaveCall();
+			throw;
+		}
 
-	DefFunc() = default;
+		/*
+		キャプチャした環境は fork 済みなのでコピーは層の共有だけで済む。
+		*/
+		auto variables = funcVal.environment();
+		m_buckUp = std::move(localVariables);
+		localVariables = std::move(variables);
 
-	DefFunc(const Expr& expr_) :
-		expr(expr_)
-	{}
+		m_buckUpScope = currentScope;
+		currentScope = funcVal.data.get();
+		++variablesVersion;
+	}
 
-	DefFunc(
-		const std::vector<Identifer>& arguments_,
-		const Expr& expr_) :
-		arguments(arguments_),
-		expr(expr_)
-	{}
+	~LocalVariablesScope()
+	{
+		localVariables = std::move(m_buckUp);
+		currentScope = m_buckUpScope;
+		++variablesVersion;
+		m_governor.release(m_bytes);
+		m_governor.leaveCall();
+	}
 
-	DefFunc(
-		const Arguments& arguments_,
-		const Expr& expr_) :
-		arguments(arguments_.arguments),
-		expr(expr_)
-	{}
+	LocalVariablesScope(const LocalVariablesScope&) = delete;
+	LocalVariablesScope& operator=(const LocalVariablesScope&) = delete;
+
+private:
+
+	EvalGovernor& m_governor;
+	size_t m_bytes;
+	Environment m_buckUp;
+	const FuncValData* m_buckUpScope;
 };
 
-inline FuncVal GetFuncVal(const Identifer& funcName)
+/*
+遅延された引数を評価する間だけ、変数環境を引数を作った時点のものと入れ替える。
+*/
+class CallerVariablesScope
 {
-	const auto funcItOpt = findVariable(funcName.name);
+public:
 
-	if (!funcItOpt)
+	CallerVariablesScope(CallerEnvironment& caller) :
+		m_caller(caller)
 	{
-		std::cerr << "Error(" << __LINE__ << "): function \"" << funcName.name << "\" was not found." << "\n";
+		swap();
 	}
 
-	const auto funcIt = funcItOpt.get();
-
-	if (!SameType(funcIt->second.type(), typeid(FuncVal)))
+	~CallerVariablesScope()
 	{
-		std::cerr << "Error(" << __LINE__ << "): function \"" << funcName.name << "\" is not a function." << "\n";
+		swap();
 	}
 
-	return boost::get<FuncVal>(funcIt->second);
-}
+	CallerVariablesScope(const CallerVariablesScope&) = delete;
+	CallerVariablesScope& operator=(const CallerVariablesScope&) = delete;
 
-struct CallFunc
-{
-	boost::variant<FuncVal, Identifer> funcRef;
-	std::vector<Expr> actualArguments;
+private:
 
-	CallFunc(
-		const FuncVal& funcVal_,
-		const std::vector<Expr>& actualArguments_) :
-		funcRef(funcVal_),
-		actualArguments(actualArguments_)
-	{}
+	void swap()
+	{
+		globalVariables.swap(m_caller.globals);
+		localVariables.swap(m_caller.locals);
+		std::swap(currentScope, m_caller.scope);
+		++bindingVersion;
+		++variablesVersion;
+	}
 
-	CallFunc(
-		const Identifer& funcName,
-		const std::vector<Expr>& actualArguments_) :
-		funcRef(funcName),
-		actualArguments(actualArguments_)
-	{}
+	CallerEnvironment& m_caller;
 };
 
 struct EvalOpt
@@ -302,39 +1188,164 @@ struct EvalOpt
 };
 
 
-inline EvalOpt Ref(const Evaluated& lhs)
+/*
+名前をたどるたびに一歩数える。
+たどった回数が見えている変数の数を超えたら、同じ名前に戻ってきている（循環している）。
+*/
+inline EvalOpt Ref(const Evaluated& lhs, EvalGovernor& governor, size_t hops = 0)
 {
-	if (SameType(lhs.type(), typeid(int)))
+	if (lhs.is<int>())
 	{
-		return EvalOpt::Int(boost::get<int>(lhs));
+		return EvalOpt::Int(lhs.get<int>());
 	}
-	else if (SameType(lhs.type(), typeid(double)))
+	else if (lhs.is<double>())
 	{
-		return EvalOpt::Double(boost::get<double>(lhs));
+		return EvalOpt::Double(lhs.get<double>());
 	}
-	else if (SameType(lhs.type(), typeid(Identifer)))
+	else if (lhs.is<Identifer>())
 	{
-		const auto name = boost::get<Identifer>(lhs).name;
-		const auto itOpt = findVariable(name);
-		if (!itOpt)
+		governor.step();
+		if (hops > localVariables.size() + globalVariables.size())
+		{
+			throw ReferenceCycleDetected();
+		}
+
+		const auto& name = lhs.get<Identifer>().name;
+		const Evaluated* value = findVariable(name);
+		if (!value)
 		{
 			std::cerr << "Error(" << __LINE__ << ")\n";
 			return EvalOpt::Double(0);
 		}
-		return Ref(itOpt.get()->second);
+		return Ref(*value, governor, hops + 1);
 		//return EvalOpt::Double();
 	}
+	else if (lhs.is<Thunk>())
+	{
+		return Ref(lhs.get<Thunk>().force(), governor, hops);
+	}
 
 	std::cerr << "Error(" << __LINE__ << ")\n";
 	return EvalOpt::Double(0);
 }
 
+/*
+副作用（変数への代入）を起こし得ない式かどうか
+関数呼び出しは本体で代入し得るので副作用ありとみなす。
+*/
+class IsPure : public boost::static_visitor<bool>
+{
+public:
+
+	bool operator()(int)const
+	{
+		return true;
+	}
+
+	bool operator()(double)const
+	{
+		return true;
+	}
+
+	bool operator()(const Identifer&)const
+	{
+		return true;
+	}
+
+	bool operator()(const SharedExpr& node)const
+	{
+		return node.node->pure;
+	}
+
+	template <class Op>
+	bool operator()(const UnaryExpr<Op>& node)const
+	{
+		return boost::apply_visitor(*this, node.lhs);
+	}
+
+	template <class Op>
+	bool operator()(const BinaryExpr<Op>& node)const
+	{
+		return boost::apply_visitor(*this, node.lhs) && boost::apply_visitor(*this, node.rhs);
+	}
+
+	bool operator()(const BinaryExpr<Assign>&)const
+	{
+		return false;
+	}
+
+	bool operator()(const DefFunc&)const
+	{
+		return true;
+	}
+
+	bool operator()(const CallFunc&)const
+	{
+		return false;
+	}
+
+	bool operator()(const Statement& statement)const
+	{
+		return isPure(statement.exprs);
+	}
+
+	bool operator()(const Lines& statement)const
+	{
+		return isPure(statement.exprs);
+	}
+
+private:
+
+	bool isPure(const std::vector<Expr>& exprs)const
+	{
+		for (const auto& expr : exprs)
+		{
+			if (!boost::apply_visitor(*this, expr))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+};
+
+inline bool isPureExpr(const Expr& expr)
+{
+	return boost::apply_visitor(IsPure(), expr);
+}
+
+struct EvalOptions
+{
+	/*
+	値が捨てられる副作用のない式を評価せず、副作用のない引数は使われるまで評価を遅らせる。
+	代入の順序は変わらない。
+	*/
+	bool lazy = false;
+
+	/*
+	名前で呼ぶ関数を呼び出し箇所ごとにキャッシュする。
+	*/
+	bool inlineCache = true;
+};
+
 //#define DEBUG_PRINT_EXPR
 
 class Eval : public boost::static_visitor<Evaluated>
 {
 public:
 
+	Eval(EvalGovernor& governor, const EvalOptions& options = EvalOptions()) :
+		m_governor(&governor),
+		m_options(options)
+	{}
+
+	Evaluated eval(const Expr& expr)const
+	{
+		m_governor->step();
+		return boost::apply_visitor(*this, expr);
+	}
+
 	Evaluated operator()(int node)const
 	{
 #ifdef DEBUG_PRINT_EXPR
@@ -361,6 +1372,40 @@ public:
 
 		return node;
 	}
+
+	Evaluated operator()(const SharedExpr& node)const
+	{
+		/*
+		共有ノード自体で一歩数えているので、中身は数えずに評価する。
+		*/
+		const SharedNode& shared = *node.node;
+
+		if (!shared.pure)
+		{
+			return boost::apply_visitor(*this, shared.expr);
+		}
+
+		if (shared.hasMemo && shared.memoVersion == variablesVersion)
+		{
+			++shared.hits;
+			return shared.memo;
+		}
+
+		/*
+		関数値は捕捉した変数環境を通してこのノードを参照し返すことがあり、覚えておくと循環して解放されない。
+		*/
+		const Evaluated result = boost::apply_visitor(*this, shared.expr);
+		if (result.is<FuncVal>())
+		{
+			return result;
+		}
+
+		shared.memo = result;
+		shared.memoVersion = variablesVersion;
+		shared.hasMemo = true;
+
+		return shared.memo;
+	}
 	
 	Evaluated operator()(const UnaryExpr<Add>& node)const
 	{
@@ -368,7 +1413,7 @@ public:
 		std::cout << "Begin UnaryExpr<Add> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
+		const Evaluated lhs = eval(node.lhs);
 
 #ifdef DEBUG_PRINT_EXPR
 		std::cout << "End UnaryExpr<Add> expression(" << ")" << std::endl;
@@ -383,9 +1428,9 @@ public:
 		std::cout << "Begin UnaryExpr<Sub> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
+		const Evaluated lhs = eval(node.lhs);
 
-		const auto ref = Ref(lhs);
+		const auto ref = Ref(lhs, *m_governor);
 		if (ref.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -408,12 +1453,12 @@ public:
 		std::cout << "Begin BinaryExpr<Add> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 		//return lhs + rhs;
 
-		const auto vl = Ref(lhs);
-		const auto vr = Ref(rhs);
+		const auto vl = Ref(lhs, *m_governor);
+		const auto vr = Ref(rhs, *m_governor);
 		if (vl.m_witch == 0 && vr.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -438,11 +1483,11 @@ public:
 		std::cout << "Begin BinaryExpr<Sub> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 
-		const auto vl = Ref(lhs);
-		const auto vr = Ref(rhs);
+		const auto vl = Ref(lhs, *m_governor);
+		const auto vr = Ref(rhs, *m_governor);
 		if (vl.m_witch == 0 && vr.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -467,11 +1512,11 @@ public:
 		std::cout << "Begin BinaryExpr<Mul> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 
-		const auto vl = Ref(lhs);
-		const auto vr = Ref(rhs);
+		const auto vl = Ref(lhs, *m_governor);
+		const auto vr = Ref(rhs, *m_governor);
 		if (vl.m_witch == 0 && vr.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -496,11 +1541,11 @@ public:
 		std::cout << "Begin BinaryExpr<Div> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 
-		const auto vl = Ref(lhs);
-		const auto vr = Ref(rhs);
+		const auto vl = Ref(lhs, *m_governor);
+		const auto vr = Ref(rhs, *m_governor);
 		if (vl.m_witch == 0 && vr.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -525,11 +1570,11 @@ public:
 		std::cout << "Begin BinaryExpr<Pow> expression(" << ")" << std::endl;
 #endif
 		
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 
-		const auto vl = Ref(lhs);
-		const auto vr = Ref(rhs);
+		const auto vl = Ref(lhs, *m_governor);
+		const auto vr = Ref(rhs, *m_governor);
 		if (vl.m_witch == 0 && vr.m_witch == 0)
 		{
 #ifdef DEBUG_PRINT_EXPR
@@ -554,13 +1599,13 @@ public:
 		std::cout << "Begin Assign expression(" << ")" << std::endl;
 #endif
 
-		const Evaluated lhs = boost::apply_visitor(*this, node.lhs);
-		const Evaluated rhs = boost::apply_visitor(*this, node.rhs);
+		const Evaluated lhs = eval(node.lhs);
+		const Evaluated rhs = eval(node.rhs);
 
 		//const auto vr = Ref(rhs);
 		//const double dr = vr.m_witch == 0 ? vr.m_0 : vr.m_1;
 
-		if (!SameType(lhs.type(), typeid(Identifer)))
+		if (!lhs.is<Identifer>())
 		{
 			std::cerr << "Error(" << __LINE__ << ")\n";
 #ifdef DEBUG_PRINT_EXPR
@@ -570,17 +1615,23 @@ public:
 			return 0.0;
 		}
 
-		const auto name = boost::get<Identifer>(lhs).name;
-		const auto it = globalVariables.find(name);
-		if (it == globalVariables.end())
+		const auto name = lhs.get<Identifer>().name;
+		const Evaluated* old = globalVariables.find(name);
+		if (!old)
 		{
 #ifdef DEBUG_PRINT_EXPR
 			std::cout << "New Variable(" << name << ")\n";
 #endif	
+			m_governor->allocate(ApproxEnvironmentBytes(1));
+		}
+		else if (old->is<FuncVal>())
+		{
+			++bindingVersion;
 		}
 		//std::cout << "Variable(" << name << ") -> " << dr << "\n";
 		//variables[name] = dr;
-		globalVariables[name] = rhs;
+		globalVariables.assign(name, rhs);
+		++variablesVersion;
 
 		//return dr;
 
@@ -596,7 +1647,7 @@ public:
 		std::cout << "Begin DefFunc expression(" << ")" << std::endl;
 #endif
 
-		auto val = FuncVal(globalVariables, defFunc.arguments, defFunc.expr);
+		auto val = FuncVal(globalVariables.fork(), defFunc.arguments, defFunc.expr);
 
 #ifdef DEBUG_PRINT_EXPR
 		std::cout << "End DefFunc expression(" << ")" << std::endl;
@@ -611,59 +1662,73 @@ public:
 		std::cout << "Begin CallFunc expression(" << ")" << std::endl;
 #endif
 
-		const auto buckUp = localVariables;
-
 		FuncVal funcVal;
 
 		if (SameType(callFunc.funcRef.type(), typeid(FuncVal)))
 		{
 			funcVal = boost::get<FuncVal>(callFunc.funcRef);
 		}
-		else if (auto itOpt = findVariable(boost::get<Identifer>(callFunc.funcRef).name))
+		else if (findCachedFunction(callFunc, funcVal))
+		{
+		}
+		else if (const Evaluated* funcPtr = findVariable(boost::get<Identifer>(callFunc.funcRef).name))
 		{
-			const Evaluated& funcRef = (*itOpt.get()).second;
-			if (SameType(funcRef.type(), typeid(FuncVal)))
+			const Evaluated& funcRef = Force(*funcPtr);
+			if (funcRef.is<FuncVal>())
 			{
-				funcVal = boost::get<FuncVal>(funcRef);
+				funcVal = funcRef.get<FuncVal>();
+				cacheFunction(callFunc, funcVal);
 			}
 			else
 			{
-				std::cerr << "Error(" << __LINE__ << "): variable \"" << (*itOpt.get()).first << "\" is not a function.\n";
+				std::cerr << "Error(" << __LINE__ << "): variable \"" << boost::get<Identifer>(callFunc.funcRef).name << "\" is not a function.\n";
 				return 0;
 			}
 		}
+		else
+		{
+			std::cerr << "Error(" << __LINE__ << "): function \"" << boost::get<Identifer>(callFunc.funcRef).name << "\" was not found.\n";
+			return 0;
+		}
 
 		//const auto& funcVal = callFunc.funcVal;
-		assert(funcVal.arguments.size() == callFunc.actualArguments.size());
+		const auto& arguments = funcVal.arguments();
+		assert(arguments.size() == callFunc.actualArguments.size());
 
 		/*
 		引数に与えられた式の評価
 		この時点ではまだ関数の外なので、ローカル変数は変わらない。
 		*/
-		std::vector<Evaluated> argumentValues(funcVal.arguments.size());
+		std::vector<Evaluated> argumentValues(arguments.size());
 
-		for (size_t i = 0; i < funcVal.arguments.size(); ++i)
+		for (size_t i = 0; i < arguments.size(); ++i)
 		{
-			argumentValues[i] = boost::apply_visitor(*this, callFunc.actualArguments[i]);
+			if (isDeferrable(callFunc.actualArguments[i]))
+			{
+				argumentValues[i] = makeThunk(callFunc.actualArguments[i]);
+			}
+			else
+			{
+				argumentValues[i] = eval(callFunc.actualArguments[i]);
+			}
 		}
 
 		/*
 		関数の評価
 		ここでのローカル変数は関数を呼び出した側ではなく、関数が定義された側のものを使うのでローカル変数を置き換える。
+		呼び出し側の環境はコピーせずに退避しておき、スコープを抜けるときに戻す。
 		*/
-		localVariables = funcVal.environment;
-
-		for (size_t i = 0; i < funcVal.arguments.size(); ++i)
+		Evaluated result;
 		{
-			localVariables[funcVal.arguments[i].name] = argumentValues[i];
-		}
+			LocalVariablesScope scope(*m_governor, funcVal);
 
-		Evaluated result = boost::apply_visitor(*this, funcVal.expr);
+			for (size_t i = 0; i < arguments.size(); ++i)
+			{
+				localVariables.assign(arguments[i].name, argumentValues[i]);
+			}
 
-		/*
-		最後にローカル変数の環境を関数の実行前のものに戻す。
-		*/
-		localVariables = buckUp;
+			result = eval(funcVal.expr());
+		}
 
 #ifdef DEBUG_PRINT_EXPR
 		std::cout << "End CallFunc expression(" << ")" << std::endl;
@@ -685,7 +1750,13 @@ public:
 #ifdef DEBUG_PRINT_EXPR
 			std::cout << "Evaluate expression(" << i << ")" << std::endl;
 #endif	
-			result = boost::apply_visitor(*this, expr);
+			if (isDiscardable(expr, &expr == &statement.exprs.back()))
+			{
+				++i;
+				continue;
+			}
+
+			result = eval(expr);
 			++i;
 		}
 
@@ -711,7 +1782,13 @@ public:
 			std::cout << "Evaluate expression(" << i << ")" << std::endl;
 #endif
 			
-			result = boost::apply_visitor(*this, expr);
+			if (isDiscardable(expr, &expr == &statement.exprs.back()))
+			{
+				++i;
+				continue;
+			}
+
+			result = eval(expr);
 			++i;
 		}
 
@@ -721,6 +1798,82 @@ public:
 
 		return result;
 	}
+
+private:
+
+	/*
+	最後以外の式の値は捨てられるので、副作用がなければ評価しなくてよい。
+	*/
+	bool isDiscardable(const Expr& expr, bool isLast)const
+	{
+		return m_options.lazy && !isLast && isPureExpr(expr);
+	}
+
+	/*
+	リテラルと変数名はそのまま値になるので遅延しない。
+	*/
+	bool isDeferrable(const Expr& expr)const
+	{
+		return m_options.lazy
+			&& !SameType(expr.type(), typeid(int))
+			&& !SameType(expr.type(), typeid(double))
+			&& !SameType(expr.type(), typeid(Identifer))
+			&& isPureExpr(expr);
+	}
+
+	bool findCachedFunction(const CallFunc& callFunc, FuncVal& funcVal)const
+	{
+		if (!m_options.inlineCache)
+		{
+			return false;
+		}
+
+		return callFunc.cache.find(currentScope ? currentScope->id : 0, bindingVersion, funcVal);
+	}
+
+	/*
+	関数の引数は呼び出しごとに変わるので、引数の名前で引いた関数は覚えない。
+	*/
+	void cacheFunction(const CallFunc& callFunc, const FuncVal& funcVal)const
+	{
+		if (!m_options.inlineCache)
+		{
+			return;
+		}
+
+		const auto& name = boost::get<Identifer>(callFunc.funcRef).name;
+		if (currentScope)
+		{
+			for (const auto& argument : currentScope->arguments)
+			{
+				if (argument.name == name)
+				{
+					return;
+				}
+			}
+		}
+
+		callFunc.cache.insert(currentScope ? currentScope->id : 0, bindingVersion, funcVal);
+	}
+
+	/*
+	遅延された引数は、この時点の変数環境で最初に値が必要になったときに評価する。
+	*/
+	Thunk makeThunk(const Expr& expr)const
+	{
+		const Eval evaluator = *this;
+		const Expr* const pExpr = &expr;
+		CallerEnvironment caller = { globalVariables.fork(), localVariables.fork(), currentScope };
+
+		return Thunk(std::make_shared<ThunkData>([evaluator, pExpr, caller]() mutable
+		{
+			CallerVariablesScope scope(caller);
+			return evaluator.eval(*pExpr);
+		}));
+	}
+
+	EvalGovernor* m_governor;
+	EvalOptions m_options;
 };
 
 class Printer : public boost::static_visitor<void>
@@ -742,6 +1895,11 @@ public:
 		std::cout << "Identifer(" << node.name << ")";
 	}
 
+	auto operator()(const SharedExpr& node)const -> void
+	{
+		boost::apply_visitor(*this, node.node->expr);
+	}
+
 	auto operator()(const UnaryExpr<Add>& node)const -> void
 	{
 		std::cout << "Plus(";
@@ -856,7 +2014,7 @@ public:
 		std::cout << "), ";
 
 		std::cout << "Definition(";
-		boost::apply_visitor(*this, defFunc.expr);
+		boost::apply_visitor(*this, *defFunc.expr);
 		std::cout << ")";
 
 		std::cout << ")";
@@ -909,24 +2067,41 @@ inline void printExpr(const Expr& expr)
 	boost::apply_visitor(Printer(), expr);
 }
 
+inline Evaluated evalExpr(const Expr& expr, EvalGovernor& governor, const EvalOptions& options = EvalOptions())
+{
+	/*
+	前回の評価の後に変数が外から書き換えられているかもしれないので、キャッシュを無効にしておく。
+	*/
+	++bindingVersion;
+	++variablesVersion;
+
+	AllocationStage stage(Stage::Eval);
+	return Eval(governor, options).eval(expr);
+}
+
 inline Evaluated evalExpr(const Expr& expr)
 {
-	return boost::apply_visitor(Eval(), expr);
+	EvalGovernor governor;
+	return evalExpr(expr, governor);
 }
 
 inline void printEvaluated(const Evaluated& evaluated)
 {
-	if (SameType(evaluated.type(), typeid(int)))
+	if (evaluated.is<int>())
+	{
+		std::cout << evaluated.get<int>();
+	}
+	else if (evaluated.is<double>())
 	{
-		std::cout << boost::get<int>(evaluated);
+		std::cout << evaluated.get<double>();
 	}
-	else if (SameType(evaluated.type(), typeid(double)))
+	else if (evaluated.is<Identifer>())
 	{
-		std::cout << boost::get<double>(evaluated);
+		std::cout << evaluated.get<Identifer>().name;
 	}
-	else if (SameType(evaluated.type(), typeid(Identifer)))
+	else if (evaluated.is<Thunk>())
 	{
-		std::cout << boost::get<Identifer>(evaluated).name;
+		printEvaluated(evaluated.get<Thunk>().force());
 	}
 	else
 	{
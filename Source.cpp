@@ -2,7 +2,110 @@
 #include "Node.hpp"
 #include "sample.tab.h"
 
-std::map<std::string, Evaluated> globalVariables;
-std::map<std::string, Evaluated> localVariables;
+Environment globalVariables;
+Environment localVariables;
+size_t bindingVersion = 0;
+const FuncValData* currentScope = nullptr;
+size_t variablesVersion = 0;
+InlineCacheStats inlineCacheStats;
 
-#include <string>
\ No newline at end of file
+#include <string>
+
+#ifdef ALLOCATION_TELEMETRY
+#include <cstdlib>
+#include <new>
+
+/*
+確保した大きさをブロックの先頭に置き、解放のときに Telemetry.hpp へ渡す。
+*/
+namespace
+{
+	const std::size_t AllocationHeader = alignof(std::max_align_t);
+
+	void* countedAllocate(std::size_t size)
+	{
+		void* block = std::malloc(size + AllocationHeader);
+		if (!block)
+		{
+			return nullptr;
+		}
+		*static_cast<std::size_t*>(block) = size;
+		AllocationTelemetry::recordAllocation(size);
+		return static_cast<char*>(block) + AllocationHeader;
+	}
+
+	void countedDeallocate(void* ptr)
+	{
+		if (!ptr)
+		{
+			return;
+		}
+		void* block = static_cast<char*>(ptr) - AllocationHeader;
+		AllocationTelemetry::recordDeallocation(*static_cast<std::size_t*>(block));
+		std::free(block);
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	for (;;)
+	{
+		if (void* ptr = countedAllocate(size))
+		{
+			return ptr;
+		}
+
+		const std::new_handler handler = std::get_new_handler();
+		if (!handler)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return countedAllocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return countedAllocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	countedDeallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	countedDeallocate(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	countedDeallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+	countedDeallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	countedDeallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	countedDeallocate(ptr);
+}
+#endif
\ No newline at end of file
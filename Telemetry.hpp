@@ -0,0 +1,246 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/*
+処理の段階ごとのメモリ確保の計測
+ALLOCATION_TELEMETRY を定義してビルドすると Source.cpp で置き換えた operator new / delete がここに記録する。
+記録は AllocationTelemetry が生きている間、そのスレッドで行われた確保だけが対象になる。
+*/
+
+enum class Stage
+{
+	Preprocess,
+	Lex,
+	Parse,
+	Eval,
+	Other,
+	Count
+};
+
+inline const char* StageName(Stage stage)
+{
+	switch (stage)
+	{
+	case Stage::Preprocess: return "preprocess";
+	case Stage::Lex: return "lex";
+	case Stage::Parse: return "parse";
+	case Stage::Eval: return "eval";
+	default: return "other";
+	}
+}
+
+/*
+allocations と bytes はその段階が一番内側のときの確保だけを数える（字句解析の分は構文解析に含めない）。
+peakBytes は段階に入ってからの使用量の増分の最大値で、内側の段階の分も含む。
+*/
+struct StageAllocations
+{
+	size_t allocations = 0;
+	size_t deallocations = 0;
+	size_t bytes = 0;
+	size_t freedBytes = 0;
+	size_t peakBytes = 0;
+};
+
+struct AllocationReport
+{
+	std::array<StageAllocations, static_cast<size_t>(Stage::Count)> stages;
+	size_t allocations = 0;
+	size_t bytes = 0;
+	size_t peakBytes = 0;
+
+	const StageAllocations& operator[](Stage stage)const
+	{
+		return stages[static_cast<size_t>(stage)];
+	}
+
+	/*
+	一行の JSON として書き出す。
+	*/
+	void writeJson(std::ostream& os, const std::string& script)const
+	{
+		os << "{\"telemetry\": \"allocations\", \"script\": \"" << escape(script) << "\"";
+		for (size_t i = 0; i < stages.size(); ++i)
+		{
+			const StageAllocations& stage = stages[i];
+			os << ", \"" << StageName(static_cast<Stage>(i)) << "\": {"
+				<< "\"allocations\": " << stage.allocations
+				<< ", \"deallocations\": " << stage.deallocations
+				<< ", \"bytes\": " << stage.bytes
+				<< ", \"freed_bytes\": " << stage.freedBytes
+				<< ", \"peak_bytes\": " << stage.peakBytes
+				<< "}";
+		}
+		os << ", \"allocations\": " << allocations
+			<< ", \"bytes\": " << bytes
+			<< ", \"peak_bytes\": " << peakBytes
+			<< "}" << std::endl;
+	}
+
+private:
+
+	static std::string escape(const std::string& str)
+	{
+		std::string result;
+		for (const char c : str)
+		{
+			switch (c)
+			{
+			case '"': result += "\\\""; break;
+			case '\\': result += "\\\\"; break;
+			case '\n': result += "\\n"; break;
+			case '\r': result += "\\r"; break;
+			case '\t': result += "\\t"; break;
+			default: result += c; break;
+			}
+		}
+		return result;
+	}
+};
+
+class AllocationTelemetry;
+
+/*
+この区間で行われた確保を stage に数える。入れ子にでき、抜けると外側の段階に戻る。
+*/
+class AllocationStage
+{
+public:
+
+	AllocationStage(Stage stage);
+	~AllocationStage();
+
+	AllocationStage(const AllocationStage&) = delete;
+	AllocationStage& operator=(const AllocationStage&) = delete;
+
+	/*
+	このスレッドで一番内側の段階（EvalTask は評価を再開するたびに自分のものと入れ替える）
+	*/
+	static AllocationStage*& Current()
+	{
+		static thread_local AllocationStage* current = nullptr;
+		return current;
+	}
+
+private:
+
+	friend class AllocationTelemetry;
+
+	Stage m_stage;
+	long long m_startLive;
+	AllocationStage* m_parent;
+};
+
+/*
+生きている間の確保を段階ごとに集計する。
+*/
+class AllocationTelemetry
+{
+public:
+
+	AllocationTelemetry() :
+		m_previous(Active())
+	{
+		Active() = this;
+	}
+
+	~AllocationTelemetry()
+	{
+		Active() = m_previous;
+	}
+
+	AllocationTelemetry(const AllocationTelemetry&) = delete;
+	AllocationTelemetry& operator=(const AllocationTelemetry&) = delete;
+
+	const AllocationReport& report()const
+	{
+		return m_report;
+	}
+
+	/*
+	置き換えた operator new / delete から呼ばれる。ここでメモリを確保してはいけない。
+	*/
+	static void recordAllocation(size_t bytes)
+	{
+		AllocationTelemetry* telemetry = Active();
+		if (!telemetry)
+		{
+			return;
+		}
+
+		AllocationReport& report = telemetry->m_report;
+		telemetry->m_live += static_cast<long long>(bytes);
+		++report.allocations;
+		report.bytes += bytes;
+		report.peakBytes = Max(report.peakBytes, telemetry->m_live);
+
+		AllocationStage* current = AllocationStage::Current();
+		StageAllocations& stage = report.stages[static_cast<size_t>(current ? current->m_stage : Stage::Other)];
+		++stage.allocations;
+		stage.bytes += bytes;
+
+		for (AllocationStage* frame = current; frame; frame = frame->m_parent)
+		{
+			StageAllocations& outer = report.stages[static_cast<size_t>(frame->m_stage)];
+			outer.peakBytes = Max(outer.peakBytes, telemetry->m_live - frame->m_startLive);
+		}
+	}
+
+	static void recordDeallocation(size_t bytes)
+	{
+		AllocationTelemetry* telemetry = Active();
+		if (!telemetry)
+		{
+			return;
+		}
+
+		telemetry->m_live -= static_cast<long long>(bytes);
+
+		AllocationStage* current = AllocationStage::Current();
+		StageAllocations& stage = telemetry->m_report.stages[static_cast<size_t>(current ? current->m_stage : Stage::Other)];
+		++stage.deallocations;
+		stage.freedBytes += bytes;
+	}
+
+	/*
+	計測を始めてからの使用量の増分（計測前に確保したものを解放すると負になる）
+	*/
+	static long long LiveBytes()
+	{
+		const AllocationTelemetry* telemetry = Active();
+		return telemetry ? telemetry->m_live : 0;
+	}
+
+private:
+
+	static AllocationTelemetry*& Active()
+	{
+		static thread_local AllocationTelemetry* active = nullptr;
+		return active;
+	}
+
+	static size_t Max(size_t peak, long long live)
+	{
+		return live > 0 && static_cast<size_t>(live) > peak ? static_cast<size_t>(live) : peak;
+	}
+
+	AllocationReport m_report;
+	long long m_live = 0;
+	AllocationTelemetry* m_previous;
+};
+
+inline AllocationStage::AllocationStage(Stage stage) :
+	m_stage(stage),
+	m_startLive(AllocationTelemetry::LiveBytes()),
+	m_parent(Current())
+{
+	Current() = this;
+}
+
+inline AllocationStage::~AllocationStage()
+{
+	Current() = m_parent;
+}
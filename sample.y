@@ -5,25 +5,70 @@
 
 	namespace yy {
         class testLexer;
+        class DfaLexer;
+
+        /*
+        USE_DFA_LEXER を定義すると flex のスキャナの代わりに DfaLexer を使う。
+        */
+#ifdef USE_DFA_LEXER
+        using Lexer = DfaLexer;
+#else
+        using Lexer = testLexer;
+#endif
     };
 
+	struct Diagnostics;
+
 	void parse(const std::vector<std::string>&, Lines* program);
 
 	//#define PRINT_EXPR(expr) 
 	#define PRINT_EXPR(expr) printExpr(expr)
 }
 
+%code provides {
+	/*
+	構文エラーは例外にせず、位置とメッセージを溜めて解析を続ける。
+	*/
+	struct Diagnostic
+	{
+		yy::location location;
+		std::string message;
+	};
+
+	struct Diagnostics
+	{
+		std::vector<Diagnostic> errors;
+
+		bool empty()const
+		{
+			return errors.empty();
+		}
+	};
+}
+
 %code {
 	#include "LexConfig.hpp"
+	#include "DfaLexer.hpp"
+
+	/*
+	字句解析で確保したメモリを構文木の構築と分けて数える。
+	*/
+	template <class Scanner, class Value, class Location>
+	int lexInStage(Scanner* scanner, Value* value, Location* location)
+	{
+		AllocationStage stage(Stage::Lex);
+		return scanner->lex(value, location);
+	}
 
 	#undef yylex
-    #define yylex scanner->lex
+    #define yylex(value, location) lexInStage(scanner, value, location)
 }
 
 %skeleton "lalr1.cc"
-%parse-param {testLexer* scanner} {Lines* program}
+%parse-param {Lexer* scanner} {Lines* program} {Diagnostics* diagnostics}
 %locations
 %define parse.error verbose
+%define parse.lac full
 %define parse.assert
 %define api.value.type variant
 
@@ -40,8 +85,7 @@
 %%
 
 prog  : %empty
-	  | lines    { *program = $1; }
-      | error LF { yyerrok; yyclearin; }
+	  | lines    { *program = std::move($1); }
 	  ;
 
 def_func : '(' ')' arrow '(' ')'                 { $$ = DefFunc(); }
@@ -54,13 +98,21 @@ arguments : NAME               { printExpr($1); $$ = $1; }
 		  ;
 
 lines : LF             {}
-      | expr_seq       { $$.concat($1); }
-	  | expr_seq LF    { $$.concat($1); }
+      | expr_seq       { $$ = std::move($1); $$.reverse(); }
+	  | expr_seq LF    { $$ = std::move($1); $$.reverse(); }
 	  ;
 
-expr_seq : expr              { $$ = $1; }
-	     | expr ',' expr_seq { $$ = $1; $$.concat($3); }
-		 | expr LF expr_seq  { $$ = $1; $$.concat($3); }
+/*
+右再帰で後ろの式から還元されるので、expr_seq の中では逆順に積み、lines で一度だけ並べ直す。
+構文エラーは式単位で読み捨て、区切り(LF / ',')を読んだ時点で次のエラーの報告を再開する。
+区切りまで error の規則に含めておかないと、読み捨てる前に error が還元されて手前の式まで巻き戻される。
+*/
+expr_seq : expr                               { $$.add(std::move($1)); }
+	     | expr ',' expr_seq                  { $$ = std::move($3); $$.add(std::move($1)); }
+		 | expr LF expr_seq                   { $$ = std::move($3); $$.add(std::move($1)); }
+	     | error                              {}
+	     | error ',' { yyerrok; } expr_seq    { $$ = std::move($4); }
+		 | error LF { yyerrok; } expr_seq     { $$ = std::move($4); }
 	     ;
 
 expr  : term          { $$ = $1;  /*PRINT_EXPR($$);*/ }
@@ -86,6 +138,14 @@ factor: VALUE         { $$ = $1;  /*PRINT_EXPR($$);*/ }
 %%
 
 #include <sstream>
+#include <random>
+#include <thread>
+#include "EvalTask.hpp"
+#include "Fuzz.hpp"
+
+#ifdef BENCHMARK
+#include "Benchmark.hpp"
+#endif
 
 /*
 https://coldfix.eu/2015/05/16/bison-c++11/
@@ -93,34 +153,587 @@ https://coldfix.eu/2015/05/16/bison-c++11/
 
 void yy::parser::error(const parser::location_type& l, const std::string& m)
 {
-    throw yy::parser::syntax_error(l, m);
+    diagnostics->errors.push_back({ l, m });
 }
 
-bool parse(const std::string& program, Lines* out)
+/*
+エラーのあった行だけを表示し、その下の同じ桁に印を付ける。
+*/
+void printDiagnostic(const Diagnostic& diagnostic, const std::string& line)
+{
+	static const std::string prefix = "in ";
+
+	int col = diagnostic.location.begin.column;
+	/* end.column は範囲の次の桁を指す */
+	int len = diagnostic.location.begin.line == diagnostic.location.end.line ? std::max(1, diagnostic.location.end.column - col) : 1;
+
+	std::cerr << diagnostic.location << ": " << diagnostic.message << "\n"
+		<< prefix << line << "\n"
+		<< std::string(prefix.size() + col - 1, ' ') << std::string(len, '^') << std::endl;
+}
+
+/*
+診断を順に表示する。
+診断はふつう行の順に並ぶので、前の診断の行から先だけを探してプログラム全体を何度も読み直さない。
+*/
+void printDiagnostics(const Diagnostics& diagnostics, const std::string& program)
 {
+	size_t begin = 0;
+	int line = 1;
+
+	for (const auto& diagnostic : diagnostics.errors)
+	{
+		const int target = diagnostic.location.begin.line;
+		if (target < line)
+		{
+			begin = 0;
+			line = 1;
+		}
+		for (; line < target && begin != std::string::npos; ++line)
+		{
+			begin = program.find('\n', begin);
+			if (begin != std::string::npos)
+			{
+				++begin;
+			}
+		}
+
+		if (begin == std::string::npos)
+		{
+			printDiagnostic(diagnostic, "");
+			continue;
+		}
+		const size_t end = program.find('\n', begin);
+		printDiagnostic(diagnostic, program.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+	}
+}
+
+bool parse(const std::string& program, Lines* out, Diagnostics* diagnostics)
+{
+	AllocationStage stage(Stage::Parse);
+
 	std::istringstream in(program);
-	yy::testLexer scanner(&in);
-	yy::parser parser(&scanner, out);
+	yy::Lexer scanner(&in);
+	yy::parser parser(&scanner, out, diagnostics);
 	try {
 		int result = parser.parse();
-		if (result != 0) {
+		if (result != 0 && diagnostics->empty()) {
 			throw std::runtime_error("Unknown parsing error");
 		}
 	}
 	catch (yy::parser::syntax_error& e) {
-		int col = e.location.begin.column;
-		int len = 1 + e.location.end.column - col;
+		diagnostics->errors.push_back({ e.location, e.what() });
+	}
+
+	printDiagnostics(*diagnostics, program);
+
+	return diagnostics->empty();
+}
+
+bool parse(const std::string& program, Lines* out)
+{
+	Diagnostics diagnostics;
+	return parse(program, out, &diagnostics);
+}
+
+/*
+flex のスキャナと DfaLexer に同じ入力を与え、トークン列と位置が一致するかを調べる。
+*/
+template <class Lexer>
+std::vector<std::string> lexAll(const std::string& source)
+{
+	std::istringstream in(source);
+	Lexer lexer(&in);
+
+	std::vector<std::string> tokens;
+	yy::parser::semantic_type value;
+	yy::parser::location_type location;
+
+	for (;;)
+	{
+		const int token = lexer.lex(&value, &location);
+
+		std::ostringstream os;
+		os << token << "@" << location;
+
+		if (token == yy::parser::token::VALUE)
+		{
+			const Expr& expr = value.as<Expr>();
+			if (SameType(expr.type(), typeid(int)))
+			{
+				os << " Int(" << boost::get<int>(expr) << ")";
+			}
+			else
+			{
+				os.precision(17);
+				os << " Double(" << boost::get<double>(expr) << ")";
+			}
+			value.destroy<Expr>();
+		}
+		else if (token == yy::parser::token::NAME)
+		{
+			os << " Identifer(" << value.as<Identifer>().name << ")";
+			value.destroy<Identifer>();
+		}
+
+		tokens.push_back(os.str());
+
+		if (token == 0)
+		{
+			return tokens;
+		}
+	}
+}
+
+std::string randomSource(std::mt19937& rng)
+{
+	const std::vector<std::string> pieces({
+		"0", "7", "42", "00", "3.", "0.5", "12.25", "1.2.3",
+		"x", "_y1", "abc", "A_9", "1abc",
+		"+", "-", "*", "/", "^", "=", ">", "<", "(", ")", "{", "}", "[", "]", ":", "\\", ",", "->", "-->",
+		" ", "  ", "\t", "\r", "\n", "\n\n",
+		".", "!", "#"
+	});
+
+	std::string source;
+	const int length = std::uniform_int_distribution<int>(0, 40)(rng);
+	for (int i = 0; i < length; ++i)
+	{
+		source += pieces[std::uniform_int_distribution<size_t>(0, pieces.size() - 1)(rng)];
+	}
+
+	return source;
+}
+
+int lexerDifferentialTest(int cases)
+{
+	std::mt19937 rng(20161203);
+	int wrongs = 0;
+
+	for (int i = 0; i < cases; ++i)
+	{
+		const std::string source = randomSource(rng);
+		const auto expected = lexAll<yy::testLexer>(source);
+		const auto actual = lexAll<yy::DfaLexer>(source);
+
+		if (expected != actual)
+		{
+			std::cout << "Lexer mismatch:\n" << source << "\n";
+			++wrongs;
+		}
+	}
+
+	return wrongs;
+}
+
+bool sameEvaluated(const Evaluated& lhs, const Evaluated& rhs)
+{
+	if (lhs.is<int>() && rhs.is<int>())
+	{
+		return lhs.get<int>() == rhs.get<int>();
+	}
+	if (lhs.is<double>() && rhs.is<double>())
+	{
+		return lhs.get<double>() == rhs.get<double>();
+	}
+	if (lhs.is<Identifer>() && rhs.is<Identifer>())
+	{
+		return lhs.get<Identifer>().name == rhs.get<Identifer>().name;
+	}
+	return false;
+}
+
+Lines sequence(const std::vector<Expr>& exprs)
+{
+	Lines lines;
+	for (const auto& expr : exprs)
+	{
+		lines.add(expr);
+	}
+	return lines;
+}
+
+/*
+同じプログラムをそのまま評価した結果と、EvalTask で数ステップずつ交互に評価した結果を比べる。
+文法には変数の参照がないので、プログラムは AST で与える。
+*/
+int taskInterleaveTest(const std::vector<Expr>& programs, size_t yieldSteps)
+{
+	std::vector<Evaluated> expected;
+	std::vector<std::unique_ptr<EvalTask>> tasks;
+
+	for (const auto& program : programs)
+	{
+		globalVariables.clear();
+		expected.push_back(evalExpr(program));
+		globalVariables.clear();
+
+		tasks.emplace_back(new EvalTask(program, yieldSteps));
+	}
+
+	std::vector<bool> finished(tasks.size(), false);
+	for (size_t remaining = tasks.size(); remaining != 0;)
+	{
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			if (!finished[i] && tasks[i]->resume())
+			{
+				finished[i] = true;
+				--remaining;
+			}
+		}
+	}
+
+	int wrongs = 0;
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		if (!sameEvaluated(expected[i], tasks[i]->result()))
+		{
+			std::cout << "Task mismatch:\n";
+			printExpr(programs[i]);
+			std::cout << "\n";
+			++wrongs;
+		}
+	}
+
+	return wrongs;
+}
+
+/*
+評価の終わっていない EvalTask を破棄しても例外が出ず、タスクの変数が外に漏れないことを確かめる。
+一度も resume していないタスクと、中断中に期限が過ぎたタスクを試す。
+*/
+int taskDisposeTest(const Expr& program, int& checks)
+{
+	int wrongs = 0;
+	checks = 0;
+
+	globalVariables.clear();
+	localVariables.clear();
+	localVariables.assign("outer", 7);
+
+	const auto check = [&](const char* name, const std::function<void()>& dispose)
+	{
+		++checks;
+		try
+		{
+			dispose();
+		}
+		catch (...)
+		{
+			std::cout << "Task dispose mismatch: " << name << " threw\n";
+			++wrongs;
+			return;
+		}
 
-		std::cerr << e.what() << "\n"
-			<< "in " << program << "\n"
-			<< "    " << std::string(col - 1, ' ') << std::string(len, '^') << std::endl;
-			
-			return false;
+		const Evaluated* outer = localVariables.find("outer");
+		if (globalVariables.size() != 0 || localVariables.size() != 1 || !outer || !outer->is<int>() || outer->get<int>() != 7 || currentScope != nullptr)
+		{
+			std::cout << "Task dispose mismatch: " << name << " leaked variables\n";
+			++wrongs;
+		}
+	};
+
+	EvalLimits expired;
+	expired.timeout = std::chrono::steady_clock::duration::zero();
+	check("unstarted", [&]()
+	{
+		EvalTask task(program, 1, expired);
+	});
+
+	EvalLimits shortLived;
+	shortLived.timeout = std::chrono::milliseconds(20);
+	check("suspended", [&]()
+	{
+		EvalTask task(program, 1, shortLived);
+		if (task.resume())
+		{
+			throw std::logic_error("task finished before suspending");
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(40));
+	});
+
+	globalVariables.clear();
+	localVariables.clear();
+
+	return wrongs;
+}
+
+/*
+呼び出し箇所のキャッシュが同じ関数の呼び出しで当たり、関数の束縛が変わった直後は外れて新しい関数を引くことを確かめる。
+h の本体の f(1) は h を定義し直しても本体を共有するので、同じ呼び出し箇所のキャッシュが使われる。
+*/
+int inlineCacheTest(int& checks)
+{
+	const Identifer f("f"), h("h"), x("x");
+	const DefFunc callF(CallFunc(f, { 1 }));
+	const CallSiteCache& site = boost::get<CallFunc>(*callF.expr).cache;
+
+	/*
+	一度の評価の中で呼ばないと、評価のたびに bindingVersion が進んでキャッシュが使われない。
+	*/
+	const Expr program = sequence({
+		BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x }), BinaryExpr<Mul>(x, 2))),
+		BinaryExpr<Assign>(h, callF),
+		CallFunc(h, {}),
+		CallFunc(h, {}),
+		CallFunc(h, {}),
+		BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x }), BinaryExpr<Mul>(x, 3))),
+		BinaryExpr<Assign>(h, callF),
+		CallFunc(h, {}),
+		CallFunc(h, {})
+	});
+
+	int wrongs = 0;
+
+	globalVariables.clear();
+	const InlineCacheStats before = inlineCacheStats;
+	const Evaluated last = evalExpr(program);
+	globalVariables.clear();
+
+	++checks;
+	if (!last.is<int>() || last.get<int>() != 3)
+	{
+		std::cout << "Inline cache mismatch: rebound function was not called\n";
+		++wrongs;
+	}
+
+	/*
+	最初の定義で 1 回外れて 2 回当たり、f と h を束縛し直した後に 1 回外れて 1 回当たる。
+	*/
+	++checks;
+	if (site.stats.hits != 3 || site.stats.misses != 2 || inlineCacheStats.hits - before.hits < site.stats.hits)
+	{
+		std::cout << "Inline cache mismatch: hits " << site.stats.hits << ", misses " << site.stats.misses << "\n";
+		++wrongs;
+	}
+
+	/*
+	覚えた関数が解放された後は外れになる。
+	*/
+	++checks;
+	CallSiteCache cache;
+	{
+		const FuncVal temporary(Environment(), std::vector<Identifer>(), std::make_shared<const Expr>(0));
+		cache.insert(0, 0, temporary);
+	}
+	FuncVal found;
+	if (cache.find(0, 0, found) || cache.size != 0)
+	{
+		std::cout << "Inline cache mismatch: expired function was returned\n";
+		++wrongs;
+	}
+
+	return wrongs;
+}
+
+/*
+同じプログラムを先行評価と遅延評価で動かし、結果が一致することを確かめる。
+*/
+int lazyTest(const std::vector<Expr>& programs)
+{
+	int wrongs = 0;
+
+	for (const auto& program : programs)
+	{
+		globalVariables.clear();
+		const Evaluated expected = evalExpr(program);
+
+		EvalOptions options;
+		options.lazy = true;
+		EvalGovernor governor;
+		globalVariables.clear();
+		const Evaluated actual = evalExpr(program, governor, options);
+		globalVariables.clear();
+
+		if (!sameEvaluated(expected, actual))
+		{
+			std::cout << "Lazy mismatch:\n";
+			printExpr(program);
+			std::cout << "\n";
+			++wrongs;
+		}
+	}
+
+	return wrongs;
+}
+
+/*
+前もって評価した変数を fork した環境でスクリプトを何度も動かし、代入が他の実行や元の環境に見えないことを確かめる。
+*/
+int forkIsolationTest(int runs)
+{
+	const Identifer a("a"), b("b"), f("f"), x("x");
+	const Expr prelude = sequence({ BinaryExpr<Assign>(a, 10), BinaryExpr<Assign>(b, 20) });
+	const Expr script = sequence({
+		BinaryExpr<Assign>(a, BinaryExpr<Add>(a, 1)),
+		BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x }), BinaryExpr<Add>(x, a))),
+		BinaryExpr<Assign>(a, 0),
+		CallFunc(f, { b })
+	});
+
+	globalVariables.clear();
+	evalExpr(prelude);
+	Environment base;
+	base.swap(globalVariables);
+
+	int wrongs = 0;
+	for (int i = 0; i < runs; ++i)
+	{
+		globalVariables = base.fork();
+		const Evaluated result = evalExpr(script);
+		if (!result.is<int>() || result.get<int>() != 31)
+		{
+			++wrongs;
+		}
+	}
+	globalVariables.clear();
+
+	const Evaluated* value = base.find("a");
+	if (!value || !value->is<int>() || value->get<int>() != 10 || base.find("f"))
+	{
+		std::cout << "Fork mismatch: prelude was modified\n";
+		++wrongs;
+	}
+
+	return wrongs;
+}
+
+/*
+資源制限を超えるプログラムが期待した例外で打ち切られ、呼び出し側のローカル変数とスコープが元に戻ることを確かめる。
+*/
+struct LimitCase
+{
+	Expr program;
+	EvalLimits limits;
+	const std::type_info* expected;
+};
+
+int limitTest(const std::vector<LimitCase>& cases)
+{
+	int wrongs = 0;
+
+	for (const auto& limitCase : cases)
+	{
+		globalVariables.clear();
+		localVariables.clear();
+		localVariables.assign("outer", 7);
+
+		const std::type_info* thrown = nullptr;
+		try
+		{
+			EvalGovernor governor(limitCase.limits);
+			evalExpr(limitCase.program, governor);
+		}
+		catch (const EvalLimitError& error)
+		{
+			thrown = &typeid(error);
+		}
+
+		const Evaluated* outer = localVariables.find("outer");
+		const bool restored = localVariables.size() == 1 && outer && outer->is<int>() && outer->get<int>() == 7 && currentScope == nullptr;
+
+		if (!thrown || !SameType(*thrown, *limitCase.expected) || !restored)
+		{
+			std::cout << "Limit mismatch: expected " << limitCase.expected->name() << "\n";
+			printExpr(limitCase.program);
+			std::cout << "\n";
+			++wrongs;
+		}
 	}
 
-	return true;
+	globalVariables.clear();
+	localVariables.clear();
+
+	return wrongs;
 }
 
+/*
+ひとつのスクリプトを前処理・構文解析・評価まで通し、段階ごとのメモリ確保を集計する。
+ALLOCATION_TELEMETRY を定義してビルドしたときだけ数値が入る。
+*/
+AllocationReport measureScript(const std::string& source)
+{
+	AllocationTelemetry telemetry;
+	{
+		std::string program;
+		{
+			AllocationStage stage(Stage::Preprocess);
+			program = preprocess(source);
+		}
+
+		Lines expr;
+		if (parse(program, &expr))
+		{
+			evalExpr(expr);
+		}
+	}
+	return telemetry.report();
+}
+
+/*
+構文エラーを含むプログラムで、すべてのエラーが報告され、エラーの前後の正しい式が残ることを確かめる。
+*/
+struct RecoveryCase
+{
+	std::string source;
+	size_t errors;
+	std::vector<int> survivors;
+};
+
+int recoveryTest(const std::vector<RecoveryCase>& cases)
+{
+	int wrongs = 0;
+
+	for (const auto& recoveryCase : cases)
+	{
+		Lines program;
+		Diagnostics diagnostics;
+		parse(preprocess(recoveryCase.source), &program, &diagnostics);
+
+		bool same = diagnostics.errors.size() == recoveryCase.errors && program.exprs.size() == recoveryCase.survivors.size();
+		for (size_t i = 0; same && i < program.exprs.size(); ++i)
+		{
+			const Evaluated value = evalExpr(program.exprs[i]);
+			same = value.is<int>() && value.get<int>() == recoveryCase.survivors[i];
+		}
+
+		if (!same)
+		{
+			std::cout << "Recovery mismatch:\n" << recoveryCase.source << "\n";
+			printExpr(program);
+			std::cout << "\n";
+			++wrongs;
+		}
+	}
+
+	return wrongs;
+}
+
+#ifdef LIBFUZZER
+/*
+libFuzzer から渡されたバイト列を生成の選択に使い、食い違いがあれば止める。
+*/
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	static DifferentialRunner runner;
+
+	FuzzChoices choices(data, size);
+	const bool variables = choices.next(2) == 1;
+	const Lines program = ProgramGenerator(choices, variables).program();
+
+	const std::string backend = runner.mismatch(program);
+	if (!backend.empty())
+	{
+		std::cout << "Fuzz mismatch (backend " << backend << "):\n";
+		printExpr(program);
+		std::cout << std::endl;
+		std::abort();
+	}
+
+	return 0;
+}
+#else
 int main()
 {
 	std::vector<std::string> test_ok({
@@ -226,4 +839,100 @@ int main()
 	std::cout << "Result:\n";
 	std::cout << "Correct programs: (Wrong / All) = (" << ok_wrongs << " / " << test_ok.size() << ")\n";
 	std::cout << "Wrong   programs: (Wrong / All) = (" << ng_wrongs << " / " << test_ng.size() << ")\n";
+
+	const std::vector<RecoveryCase> test_recovery({
+		{ "8, 2*3, 3 * * 4, 5", 1, { 8, 6, 5 } },
+		{ "2*3 \n 3 * * 4 \n 5", 1, { 6, 5 } },
+		{ "1 + * 2, 3, 4 * / 5, 6", 2, { 3, 6 } },
+		{ "7 \n ) 1 ( \n 8", 1, { 7, 8 } },
+		{ "1, 2 + + * 3", 1, { 1 } }
+	});
+	const int recovery_wrongs = recoveryTest(test_recovery);
+	std::cout << "Recovery results: (Wrong / All) = (" << recovery_wrongs << " / " << test_recovery.size() << ")\n";
+
+	const int lexerCases = 1000;
+	const int lexer_wrongs = lexerDifferentialTest(lexerCases);
+	std::cout << "Lexer    outputs: (Wrong / All) = (" << lexer_wrongs << " / " << lexerCases << ")\n";
+
+	const Identifer a("a"), f("f"), s("s"), x("x"), y("y"), z("z");
+	const std::vector<Expr> test_tasks({
+		sequence({ BinaryExpr<Assign>(a, 1), BinaryExpr<Assign>(a, BinaryExpr<Add>(a, 2)), BinaryExpr<Assign>(a, BinaryExpr<Mul>(a, 3)), BinaryExpr<Add>(a, 0) }),
+		sequence({ BinaryExpr<Assign>(x, 2.5), BinaryExpr<Assign>(y, BinaryExpr<Mul>(x, x)), BinaryExpr<Assign>(z, BinaryExpr<Sub>(y, x)), BinaryExpr<Div>(z, 2) }),
+		sequence({ BinaryExpr<Assign>(s, 0), BinaryExpr<Assign>(s, BinaryExpr<Add>(s, 1)), BinaryExpr<Assign>(s, BinaryExpr<Add>(s, 2)), BinaryExpr<Assign>(s, BinaryExpr<Add>(s, 3)), BinaryExpr<Mul>(s, s) }),
+		sequence({ BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x }), BinaryExpr<Mul>(x, 2))), CallFunc(f, { 20 }), CallFunc(f, { BinaryExpr<Add>(CallFunc(f, { 1.5 }), 1) }) })
+	});
+	int disposeChecks = 0;
+	const int task_wrongs = taskInterleaveTest(test_tasks, 2) + taskDisposeTest(test_tasks[0], disposeChecks);
+	std::cout << "Task     results: (Wrong / All) = (" << task_wrongs << " / " << test_tasks.size() + disposeChecks << ")\n";
+
+	/*
+	遅延された引数は、後の引数の評価中に呼ばれた関数の中の代入や引数名に影響されない。
+	*/
+	const Identifer b("b"), g("g");
+	const std::vector<Expr> test_lazy({
+		sequence({
+			BinaryExpr<Assign>(a, 2),
+			BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x, y }), BinaryExpr<Add>(x, 0))),
+			BinaryExpr<Assign>(g, DefFunc(std::vector<Identifer>({ a }), sequence({ BinaryExpr<Assign>(b, 5), BinaryExpr<Add>(a, 0) }))),
+			CallFunc(f, { BinaryExpr<Mul>(a, 2), CallFunc(g, { 100 }) })
+		}),
+		sequence({
+			BinaryExpr<Assign>(a, 2),
+			BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x, y }), BinaryExpr<Add>(y, x))),
+			BinaryExpr<Assign>(g, DefFunc(std::vector<Identifer>({ x }), sequence({ BinaryExpr<Assign>(a, x), x }))),
+			CallFunc(f, { BinaryExpr<Mul>(a, 3), CallFunc(g, { 10 }) })
+		})
+	});
+	const int lazy_wrongs = lazyTest(test_lazy);
+	std::cout << "Lazy     results: (Wrong / All) = (" << lazy_wrongs << " / " << test_lazy.size() << ")\n";
+
+	int cacheChecks = 0;
+	const int cache_wrongs = inlineCacheTest(cacheChecks);
+	std::cout << "Cache    results: (Wrong / All) = (" << cache_wrongs << " / " << cacheChecks << ")\n";
+
+	const int forkRuns = 3;
+	const int fork_wrongs = forkIsolationTest(forkRuns);
+	std::cout << "Fork     results: (Wrong / All) = (" << fork_wrongs << " / " << forkRuns << ")\n";
+
+	const Expr recursion = sequence({ BinaryExpr<Assign>(f, DefFunc(std::vector<Identifer>({ x }), CallFunc(f, { x }))), CallFunc(f, { 1 }) });
+	EvalLimits stepLimits;
+	stepLimits.maxSteps = 500;
+	EvalLimits memoryLimits;
+	memoryLimits.maxBytes = 5 * ApproxEnvironmentBytes(1);
+	EvalLimits timeLimits;
+	timeLimits.timeout = std::chrono::steady_clock::duration::zero();
+	EvalLimits depthLimits;
+	depthLimits.maxSteps = 10000000;
+	const std::vector<LimitCase> test_limits({
+		{ recursion, stepLimits, &typeid(StepLimitExceeded) },
+		{ recursion, memoryLimits, &typeid(MemoryLimitExceeded) },
+		{ recursion, timeLimits, &typeid(TimeLimitExceeded) },
+		{ recursion, depthLimits, &typeid(CallDepthExceeded) },
+		{ sequence({ BinaryExpr<Assign>(a, b), BinaryExpr<Assign>(b, a), BinaryExpr<Add>(a, 1) }), EvalLimits(), &typeid(ReferenceCycleDetected) }
+	});
+	const int limit_wrongs = limitTest(test_limits);
+	std::cout << "Limit    results: (Wrong / All) = (" << limit_wrongs << " / " << test_limits.size() << ")\n";
+
+	FuzzOptions fuzz;
+	fuzz.cases = 300;
+	fuzz.parse = [](const std::string& source, Lines* out) { return parse(preprocess(source), out); };
+	const int grammar_wrongs = differentialFuzz(fuzz);
+	fuzz.variables = true;
+	fuzz.corpus = FuzzRegressions();
+	const int variable_wrongs = differentialFuzz(fuzz);
+	std::cout << "Fuzz     results: (Wrong / All) = (" << grammar_wrongs + variable_wrongs << " / " << 2 * fuzz.cases + fuzz.corpus.size() << ")\n";
+
+#ifdef ALLOCATION_TELEMETRY
+	for (const auto& source : test_ok)
+	{
+		measureScript(source).writeJson(std::cout, source);
+	}
+#endif
+
+#ifdef BENCHMARK
+	benchmarkEvaluated(std::cout);
+	benchmarkHashCons(std::cout);
+	benchmarkFork(std::cout);
+#endif
 }
+#endif